@@ -22,6 +22,7 @@
 #pragma once
 
 #include <vector>
+#include <unordered_map>
 #include "stream.hpp"
 
 namespace ole
@@ -34,11 +35,14 @@ namespace ole
 	// Construction (only the storage can construct new paths)
 	public:
 		stream_path(const ole::stream_path& other): 
-		   _path(other._path), _stream(other._stream), _ref_count(0) {}
+		   _path(other._path), _stream(other._stream), _storage(other._storage), _ref_count(0) {}
 		stream_path(POLE::Stream* st, const std::string& src): 
-		   _stream(st), _path(src), _ref_count(0) {}
+		   _stream(st), _path(src), _storage(NULL), _ref_count(0) {}
 		stream_path(POLE::Stream* st, const char* src):
-		   _stream(st), _path(src), _ref_count(0) {}
+		   _stream(st), _path(src), _storage(NULL), _ref_count(0) {}
+		// The stream is opened from storage the first time it is used
+		stream_path(POLE::Storage* storage, const std::string& src):
+		   _stream(NULL), _path(src), _storage(storage), _ref_count(0) {}
 	    
 	// Attributes
 	public:
@@ -65,19 +69,26 @@ namespace ole
 	public:
 		// Return the contained stream
 		// TODO: Que hacer en caso que se pase de 255??
-		ole::basic_stream& stream() { _ref_count++; return _stream; }
+		ole::basic_stream& stream() { open(); _ref_count++; return _stream; }
 		// Decrement the Reference Count varaible
 		void close() { if (_ref_count > 0) _ref_count--; }
 
-		ole::stream_path& operator=( const ole::stream_path& other ) { _path = other._path; _stream = other._stream; return *this; }
+		ole::stream_path& operator=( const ole::stream_path& other ) { _path = other._path; _stream = other._stream; _storage = other._storage; return *this; }
 
 	// Implementation
 	private:
 		friend class ole::compound_document; // To allow construction
 		friend class storage_path; // To allow construction
 
+		void open() 
+		{
+			if (_storage && !_stream._stream)
+				_stream._stream = _storage->stream(_path);
+		}
+
 		ole::basic_stream _stream;
 		std::string _path;
+		POLE::Storage* _storage; // Storage to open the stream from, if not opened yet
 		unsigned char _ref_count;
 		
 	
@@ -90,25 +101,26 @@ namespace ole
 	// Constructor
 	public:
 		storage_path(const std::string& path_str):
-		  _path(path_str) {}
+		  _path(path_str), _document(NULL), _expanded(true) {}
     // Operations
 	public:
 		typedef std::vector<ole::stream_path>::iterator stream_iterator;
-		std::vector<ole::stream_path>::iterator begin() { return _streams.begin(); }
-		std::vector<ole::stream_path>::iterator end() { return _streams.end(); }
-		void add_child(const ole::stream_path& path) { _streams.push_back(path); }
+		std::vector<ole::stream_path>::iterator begin() { expand(); return _streams.begin(); }
+		std::vector<ole::stream_path>::iterator end() { expand(); return _streams.end(); }
+		void add_child(const ole::stream_path& path) 
+		{ 
+			// the first stream with a given path is the one found
+			_index.insert(std::make_pair(path.string(), _streams.size()));
+			_streams.push_back(path); 
+		}
 		// Find a stream in the storage
 		std::vector<ole::stream_path>::iterator find_stream(const std::string& path)
 		{
-			for (std::vector<ole::stream_path>::iterator it = _streams.begin();
-				it != _streams.end(); 
-				++it)
-			{
-				if (it->string() == path)
-					return it;
-			}
-
-			return _streams.end();
+			expand();
+			std::unordered_map<std::string, size_t>::const_iterator it = _index.find(path);
+			if (it == _index.end())
+				return _streams.end();
+			return _streams.begin() + it->second;
 		}
 
 		// Returns a specific stream iterator 
@@ -132,10 +144,32 @@ namespace ole
 
 			return _path.substr(pos + 1, _path.size() - pos); 
 		}
-	// Members
+	// Implementation
 	private:
-		friend class ole::compound_document; // To allow construction
+		friend class ole::compound_document; // To allow construction and removal
+
+		// A storage of a lazy document lists its entries the first time they are used
+		storage_path(const std::string& path_str, ole::compound_document* document):
+		  _path(path_str), _document(document), _expanded(false) {}
+		void expand();
+
+		// Remove a stream, the streams after it move down one slot
+		bool remove_stream(const std::string& path)
+		{
+			std::vector<ole::stream_path>::iterator it = find_stream(path);
+			if (it == _streams.end())
+				return false;
+			_streams.erase(it);
+			_index.clear();
+			for (size_t i = 0; i < _streams.size(); ++i)
+				_index.insert(std::make_pair(_streams[i].string(), i));
+			return true;
+		}
+
 		std::string _path;
 		std::vector<ole::stream_path> _streams;
+		std::unordered_map<std::string, size_t> _index; // path to slot in _streams
+		ole::compound_document* _document; // Document to list the entries from, if not listed yet
+		bool _expanded;
 	};
 }// end namespace ole
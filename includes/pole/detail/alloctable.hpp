@@ -21,10 +21,47 @@
 #pragma once
 
 #include <vector>
+#include <cstdint>
 
 namespace POLE
 {
 
+// Chain of blocks stored as runs of consecutive blocks (extents), so
+// that its size depends on the fragmentation rather than the length
+class BlockChain
+{
+public:
+	struct Extent
+	{
+		uint32_t start;  // first block of the run
+		uint32_t length; // number of blocks in the run
+		uint32_t offset; // position of the first block in the chain
+	};
+
+// Construction/destruction
+public:
+	BlockChain(): _count(0) {}
+
+// Attributes
+public:
+	size_t size() const { return _count; } // number of blocks
+	bool empty() const { return (_count == 0); }
+	ULONG32 operator[]( size_t index ) const;
+	// index of the extent holding the index-th block of the chain
+	size_t find( size_t index ) const;
+	const std::vector<Extent>& extents() const { return _extents; }
+
+// Operations
+public:
+	void clear() { _extents.clear(); _count = 0; }
+	void push_back( ULONG32 block );
+
+// Implementation
+private:
+	std::vector<Extent> _extents;
+	size_t _count;
+};
+
 class AllocTable
 {
 public:
@@ -42,12 +79,23 @@ public:
 	size_t count() const { return _data.size(); } // number of blocks
 	ULONG32 block_size() const { return _block_size; } // block size
     ULONG32 operator[]( size_t index ) const { return _data[index]; }
+    // true if one of count entries from first was set since clean()
+    bool modified( size_t first, size_t count ) const;
     bool follow( ULONG32 start, std::vector<ULONG32>& chain ) const;
+    bool follow( ULONG32 start, BlockChain& chain ) const;
+    // true if a block before n is free
+    bool unused_before( size_t n ) const;
 
 // Operations
 public:
-	void set_block_size(ULONG32 size) { _block_size = size; _data.clear(); resize( 128 ); }
+	void set_block_size(ULONG32 size) { _block_size = size; _data.clear(); _first_free = 0; resize( 128 ); }
     void set_chain( const std::vector<ULONG32>& chain );
+    // first free block from index from, the table is enlarged when full
+    size_t unused( size_t from = 0 );
+    void set( size_t index, ULONG32 val );
+    // mark the blocks of the chain from start as free, returns their number
+    size_t release( ULONG32 start );
+    void clean() { _dirty.assign( _data.size(), false ); }
 
     bool load( const unsigned char* buffer, size_t len );
     bool save( unsigned char* buffer, size_t len );
@@ -55,12 +103,12 @@ public:
 
 // Implementation
 private:
-	void resize( size_t newsize ) { _data.resize( newsize,  Avail); }
-    size_t unused();
+	void resize( size_t newsize ) { _data.resize( newsize, (uint32_t)Avail ); _dirty.resize( newsize, false ); }
 	void preserve( size_t n ) { unused(); }
-    void set( size_t index, ULONG32 val );
 
-    std::vector<ULONG32> _data;
+    std::vector<uint32_t> _data; // FAT entries, exactly 32-bit as on disk
+    std::vector<bool> _dirty;    // entries set since the last clean()
+    size_t _first_free;          // no free block before this one
     ULONG32 _block_size;
     
 	AllocTable( const AllocTable& ); // No copy construction
@@ -0,0 +1,87 @@
+/* POLE - Portable C++ library to access OLE Storage
+   Copyright (C) 2002-2004 Ariya Hidayat <ariya@kde.org>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, US
+*/
+
+// sector cache header
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace POLE
+{
+
+// Least recently used sectors of a storage, shared by all its streams.
+// Sectors are numbered by their position in the file (the header is 0)
+// and kept up to date by write(). All members can be used from several
+// threads at once.
+class SectorCache
+{
+// Construction/destruction
+public:
+	SectorCache(): _sector_size(512), _capacity(0), _hits(0), _misses(0) {}
+
+// Attributes
+public:
+	size_t sector_size() const { return _sector_size; }
+	// number of unpinned sectors kept, 0 if disabled
+	size_t capacity() const { return _capacity; }
+	size_t size() const;
+	unsigned long long hits() const;
+	unsigned long long misses() const;
+
+// Operations
+public:
+	void set_sector_size( size_t size );
+	void set_capacity( size_t sectors );
+	// Copies len bytes at offset of sector into data, false if not cached
+	bool get( size_t sector, size_t offset, unsigned char* data, size_t len );
+	// Adds the content of a sector, size bytes as it may be the last one
+	void put( size_t sector, const unsigned char* data, size_t size );
+	// Pinned sectors are kept whatever the capacity, until unpinned
+	void pin( size_t sector, bool pinned = true );
+	bool pinned( size_t sector ) const;
+	// Updates the cached sectors overlapping len bytes written at pos
+	void write( size_t pos, const unsigned char* data, size_t len );
+	void clear();
+
+// Implementation
+private:
+	struct Slot
+	{
+		std::vector<unsigned char> data;
+		std::list<size_t>::iterator lru; // position in _lru, unless pinned
+		bool pinned;
+	};
+	void evict();
+
+	size_t _sector_size;
+	size_t _capacity;
+	std::unordered_map<size_t, Slot> _slots;
+	std::list<size_t> _lru; // unpinned sectors, most recently used first
+	unsigned long long _hits;
+	unsigned long long _misses;
+	mutable std::mutex _lock;
+
+	SectorCache( const SectorCache& ); // No copy construction
+	SectorCache& operator=( const SectorCache& ); // No copy operator
+};
+
+}
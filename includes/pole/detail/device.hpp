@@ -0,0 +1,204 @@
+/* POLE - Portable C++ library to access OLE Storage
+   Copyright (C) 2002-2004 Ariya Hidayat <ariya@kde.org>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, US
+*/
+
+// device header
+#pragma once
+
+#include <cstddef>
+#include <iosfwd>
+#include <mutex>
+#include <vector>
+#include "filemap.hpp"
+
+namespace POLE
+{
+
+// Random access storage the compound document is read from and
+// written to. Implement it to read documents from any other source.
+// read_at may be called from several threads at once.
+class BlockDevice
+{
+// Construction/destruction
+public:
+	virtual ~BlockDevice() {}
+
+// Attributes
+public:
+	virtual bool good() const = 0;
+	virtual bool writable() const = 0;
+	virtual size_t size() const = 0;
+	// Address of the whole content if it is in memory, NULL otherwise.
+	// It stays valid until the next write_at.
+	virtual const unsigned char* data() const { return NULL; }
+
+// Operations
+public:
+	// Both return the number of bytes transferred
+	virtual size_t read_at( size_t pos, unsigned char* buffer, size_t len ) = 0;
+	virtual size_t write_at( size_t pos, const unsigned char* buffer, size_t len ) = 0;
+	virtual bool flush() { return true; }
+	// Flush, then wait until the data written reached permanent storage
+	virtual bool sync() { return flush(); }
+	// Cuts the device to size bytes, false if it can't be done
+	virtual bool truncate( size_t /*size*/ ) { return false; }
+	// Hint that len bytes at pos are going to be read, the device may
+	// start fetching them in the background
+	virtual void advise( size_t /*pos*/, size_t /*len*/ ) {}
+};
+
+// Device over a std::iostream, optionally owning a std::fstream.
+// Seeking and reading the stream are serialized.
+class StreamDevice : public BlockDevice
+{
+// Construction/destruction
+public:
+	StreamDevice();
+	explicit StreamDevice( std::iostream* stream );
+	~StreamDevice() { close(); }
+
+// Attributes
+public:
+	bool good() const;
+	bool writable() const { return good(); }
+	size_t size() const { return _size; }
+
+// Operations
+public:
+	bool open( const char* filename, bool create = false );
+	void close();
+	size_t read_at( size_t pos, unsigned char* buffer, size_t len );
+	size_t write_at( size_t pos, const unsigned char* buffer, size_t len );
+	bool flush();
+
+// Implementation
+private:
+	std::iostream* _stream;
+	bool _owned;
+	size_t _size;
+	std::mutex _lock; // guards the stream, its position and _size
+
+	StreamDevice( const StreamDevice& ); // No copy construction
+	StreamDevice& operator=( const StreamDevice& ); // No copy operator
+};
+
+// Device over a file descriptor using pread/pwrite, no stream state
+// or buffering in between
+class FileDevice : public BlockDevice
+{
+// Construction/destruction
+public:
+	FileDevice();
+	~FileDevice() { close(); }
+
+// Attributes
+public:
+	bool good() const { return _valid; }
+	bool writable() const { return _valid && _writable; }
+	size_t size() const { return _size; }
+
+// Operations
+public:
+	// Opens read/write, or read-only if the file can't be written.
+	// create truncates or creates the file.
+	bool open( const char* filename, bool create = false );
+#if defined(WIN32)
+	bool open( const wchar_t* filename, bool create = false );
+#endif
+	void close();
+	size_t read_at( size_t pos, unsigned char* buffer, size_t len );
+	size_t write_at( size_t pos, const unsigned char* buffer, size_t len );
+	bool flush();
+	bool sync();
+	bool truncate( size_t size );
+	void advise( size_t pos, size_t len );
+
+// Implementation
+private:
+#if defined(WIN32)
+	bool attach( void* file, bool writable );
+	void* _file;
+#else
+	int _fd;
+#endif
+	bool _valid;
+	bool _writable;
+	bool _unsynced; // written since the last sync
+	size_t _size;
+
+	FileDevice( const FileDevice& ); // No copy construction
+	FileDevice& operator=( const FileDevice& ); // No copy operator
+};
+
+// Read-only device over a memory mapping of the file
+class MappedDevice : public BlockDevice
+{
+// Attributes
+public:
+	bool good() const { return _map.valid(); }
+	bool writable() const { return false; }
+	size_t size() const { return _map.size(); }
+	const unsigned char* data() const { return _map.data(); }
+
+// Operations
+public:
+	bool open( const char* filename ) { return _map.open( filename ); }
+#if defined(WIN32)
+	bool open( const wchar_t* filename ) { return _map.open( filename ); }
+#endif
+	void close() { _map.close(); }
+	size_t read_at( size_t pos, unsigned char* buffer, size_t len );
+	size_t write_at( size_t, const unsigned char*, size_t ) { return 0; }
+	void advise( size_t pos, size_t len );
+
+// Implementation
+private:
+	FileMap _map;
+};
+
+// Device over a memory buffer: either a growable buffer of its own or
+// a read-only view of the caller's data, which is not copied
+class MemoryDevice : public BlockDevice
+{
+// Construction/destruction
+public:
+	MemoryDevice(): _view(NULL), _size(0) {}
+	MemoryDevice( const void* data, size_t len ): _view((const unsigned char*)data), _size(len) {}
+
+// Attributes
+public:
+	bool good() const { return true; }
+	bool writable() const { return (_view == NULL); }
+	size_t size() const { return _size; }
+	const unsigned char* data() const;
+	const std::vector<unsigned char>& buffer() const { return _buffer; }
+
+// Operations
+public:
+	size_t read_at( size_t pos, unsigned char* buffer, size_t len );
+	size_t write_at( size_t pos, const unsigned char* buffer, size_t len );
+	bool truncate( size_t size );
+
+// Implementation
+private:
+	std::vector<unsigned char> _buffer;
+	const unsigned char* _view;
+	size_t _size;
+};
+
+}
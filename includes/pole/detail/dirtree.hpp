@@ -22,6 +22,7 @@
 
 #include <vector>
 #include <string>
+#include <unordered_map>
 
 namespace POLE
 {
@@ -30,6 +31,8 @@ class DirEntry
 {
 public:
     static const unsigned End;
+	// colors of the red-black tree of siblings
+	enum { Red = 0, Black = 1 };
   
 // Construction/destruction  
 public:
@@ -42,11 +45,12 @@ public:
 		_next(End),
 		_child(End),
 		_index(0),
+		_color(Black),
 		_modif(false)
 	{}
-	DirEntry(const std::string& name, ULONG16 len, ULONG8 type, ULONG32 size, ULONG32 start, ULONG32 prev, ULONG32 next, ULONG32 child, size_t index)
+	DirEntry(const std::string& name, ULONG16 len, ULONG8 type, ULONG32 size, ULONG32 start, ULONG32 prev, ULONG32 next, ULONG32 child, size_t index, bool modif = false)
 	{ 
-		set(name, len, type, size, start, prev, next, child, index);
+		set(name, len, type, size, start, prev, next, child, index, modif);
 	}
 
 // Attributes
@@ -64,6 +68,9 @@ public:
 	ULONG32 child() const { return _child; }
 	bool modified() const { return _modif; }
 	size_t index() const { return _index; }
+	ULONG8 color() const { return _color; }
+	// Compare names the way siblings are ordered: <0, 0 or >0
+	static int compare_names( const std::string& a, const std::string& b );
 
 // Operations
 public:
@@ -78,6 +85,7 @@ public:
 		_next = next;
 		_child = child;
 		_index = index;
+		_color = Black;
 		_modif = modif;
 	}
 	void set_name(const std::string& name) { _name = name; set_modif(); }
@@ -88,6 +96,7 @@ public:
 	void set_prev(ULONG32 prev) { _prev = prev; set_modif(); }
 	void set_next(ULONG32 next) { _next = next; set_modif(); }
 	void set_child(ULONG32 child) { _child = child; set_modif(); }
+	void set_color(ULONG8 color) { _color = color; set_modif(); }
 	void set_modif(bool modif = true) { _modif = modif; }
 
 		
@@ -102,25 +111,35 @@ private:
     ULONG32 _next;      // next sibling
     ULONG32 _child;     // first child
 	size_t _index;		// index of the entry in the directory
+	ULONG8 _color;      // red or black
 	bool _modif;
 };
 
 class DirTree
 {
+public:
+	// index of no entry, e.g. the parent of an unreachable one
+	static const size_t None;
+
 // Construction/destruction  
 public:
-	DirTree(): _current(0) { clear(); }
+	DirTree(): _current(0), _paths_valid(false) { clear(); }
 
 // Attributes
 public:
     size_t entryCount() const { return _entries.size(); }
     size_t indexOf( const DirEntry* e ) const;
-    size_t parent( size_t index ) const;
+    size_t parent( size_t index ) const { return ( index < _parents.size() ) ? _parents[index] : None; }
     void fullName( size_t index, std::string& ) const;
     void path( std::string& result) const {  fullName( _current, result ); }
     void children( size_t index, std::vector<size_t>& ) const;
     void listDirectory(std::vector<const DirEntry*>&) const;
     const DirEntry* entry( size_t index ) const;
+    // true if one of count entries from first was changed since clean()
+    bool modified( size_t first, size_t count ) const;
+    DirEntry* entry( size_t index ) { return _entry( index ); }
+    // full path of every reachable entry and its index
+    const std::unordered_map<std::string, size_t>& paths() const { return _paths; }
 	
 // Operations
 public:
@@ -129,23 +148,45 @@ public:
     bool enterDirectory( const std::string& dir );
     void leaveDirectory();
     
-	bool delete_entry(const std::string& path, int level = 0 );
+	bool delete_entry(const std::string& path);
 	bool load( unsigned char* buffer, size_t len );
     bool save( unsigned char* buffer, size_t len );
+    // Write the entries from first on, len/128 of them at most
+    bool save( size_t first, unsigned char* buffer, size_t len );
+    void clean();
+    // Link the children of every storage as balanced red-black trees
+    // sorted by name
+    void balance();
     void debug();
   
 // Implementation
 private:
 	DirEntry* _entry( size_t index );
 	DirEntry* _entry( const std::string& name, bool create=false );
-	void find_siblings( std::vector<size_t>& result, ULONG32 index ) const;
+	// visited is all false before and after, allocated once by callers
+	// looking at the children of many entries
+	void children( size_t index, std::vector<size_t>& result, std::vector<bool>& visited ) const;
+	void find_siblings( std::vector<size_t>& result, ULONG32 index, std::vector<bool>& visited ) const;
+	size_t find_child( size_t index, const std::string& name ) const;
+	void insert_child( size_t parent, size_t index );
+	void relink( size_t above, size_t parent, size_t from, size_t to );
+	void check_sorted();
+	ULONG32 link_siblings( const std::vector<size_t>& sorted, size_t first, size_t last, size_t depth, size_t red_depth );
 	size_t search_prev_link( size_t entry );
 	size_t find_rightmost_sibling(size_t left_sib);
 	bool set_prev_link(size_t prev_link, size_t entry, ULONG32 value);
+	void build_parents();
+	void build_paths();
+	void invalidate_paths() { _paths.clear(); _paths_valid = false; }
+	bool delete_entry(const std::string& path, int level);
 
 
 	size_t _current;
     std::vector<DirEntry> _entries;
+    std::vector<size_t> _parents; // parent of each entry, -1 if unreachable
+    std::vector<bool> _unsorted;  // storages whose children are not a tree sorted by name
+    std::unordered_map<std::string, size_t> _paths; // full path of each entry, built on demand
+    bool _paths_valid;
     
 	DirTree( const DirTree& );
     DirTree& operator=( const DirTree& );
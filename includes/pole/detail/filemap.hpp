@@ -0,0 +1,64 @@
+/* POLE - Portable C++ library to access OLE Storage
+   Copyright (C) 2002-2004 Ariya Hidayat <ariya@kde.org>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, US
+*/
+
+// filemap header
+#pragma once
+
+#include <cstddef>
+
+namespace POLE
+{
+
+// Read-only memory mapping of a whole file
+class FileMap
+{
+// Construction/destruction
+public:
+	FileMap();
+	~FileMap() { close(); }
+
+// Attributes
+public:
+	bool valid() const { return (_data != NULL); }
+	const unsigned char* data() const { return _data; }
+	size_t size() const { return _size; }
+
+// Operations
+public:
+	bool open( const char* filename );
+#if defined(WIN32)
+	bool open( const wchar_t* filename );
+#endif
+	void close();
+
+// Implementation
+private:
+#if defined(WIN32)
+	bool map( void* file );
+	void* _file;
+	void* _mapping;
+#endif
+	const unsigned char* _data;
+	size_t _size;
+
+	FileMap( const FileMap& ); // No copy construction
+	FileMap& operator=( const FileMap& ); // No copy operator
+};
+
+}
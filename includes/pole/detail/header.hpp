@@ -47,6 +47,13 @@ public:
     
 // Operations
 public:
+	void set_num_bat( unsigned n ) { _num_bat = n; }
+	void set_bb_block( unsigned i, ULONG32 block ) { _bb_blocks[i] = block; }
+	void set_dirent_start( unsigned block ) { _dirent_start = block; }
+	void set_sbat_start( unsigned block ) { _sbat_start = block; }
+	void set_num_sbat( unsigned n ) { _num_sbat = n; }
+	void set_mbat_start( unsigned block ) { _mbat_start = block; }
+	void set_num_mbat( unsigned n ) { _num_mbat = n; }
     bool load( const unsigned char* buffer, size_t len );
     bool save( unsigned char* buffer, size_t len );
     void debug();
@@ -21,10 +21,14 @@
 #pragma once
 
 #include <fstream>
+#include <functional>
 #include <list>
 #include "header.hpp"
 #include "dirtree.hpp"
 #include "alloctable.hpp"
+#include "device.hpp"
+#include "cache.hpp"
+#include "workers.hpp"
 
 namespace POLE
 {
@@ -34,41 +38,69 @@ class StreamImpl;
 class StorageIO
 {
 public:
+	typedef std::function<void( const std::string&, const unsigned char*, unsigned long )> ExtractCallback;
+
 	enum { Ok, OpenFailed, NotOLE, BadOLE, UnknownError, StupidWorkaroundForBrokenCompiler=255 };
+	// Open modes, see POLE::Storage
+	enum { ReadWrite = 0, MemoryMapped = 1, PreloadMiniStream = 2, Transacted = 4 };
+	// Sectors kept in the cache unless changed, reads of more sectors
+	// than CachedReadSectors don't go through the cache
+	enum { DefaultCacheSectors = 64, CachedReadSectors = 4 };
+	// Threads reading for the asynchronous reads of the streams
+	enum { AsyncReadThreads = 4 };
 
 // Construction/destruction  
 public:
-    StorageIO( const char* filename );
+    StorageIO( const char* filename, int mode = ReadWrite );
 #if defined(WIN32)
-	StorageIO(const wchar_t* filename);
+	StorageIO(const wchar_t* filename, int mode = ReadWrite);
 #endif	
 	StorageIO( std::iostream* stream );
+	// The device is not owned and must outlive the storage
+	StorageIO( BlockDevice* device, int mode = ReadWrite );
+	// Read-only storage parsed in place from the caller's buffer
+	StorageIO( const void* data, size_t len );
     ~StorageIO();
     
 // Attributes
 public:
 	int result() const { return _result; }
+	// true if the whole device is addressable in memory
+	bool mapped() const { return _device && _device->data(); }
+	// true if smallBlockData can address every small block
+	bool direct_small_blocks() const { return mapped() || _mini_loaded; }
+	// true if changes are only saved by commit
+	bool transacted() const { return _transacted; }
+	// counts the changes to the blocks of streams, chains followed before
+	// the last change may be out of date
+	unsigned long chain_changes() const { return _chain_changes; }
 	const Header* header() const { return _header; }
+	// sectors read recently, shared by all streams
+	SectorCache& cache() { return _cache; }
+	// threads running asynchronous reads, started on first use
+	WorkerPool& workers();
 	const DirEntry* entry(const std::string& path, bool create = false) const { return _dirtree->entry(path, create); }
 	void path( std::string& result) const { _dirtree->path(result); }
 	void listDirectory(std::list<std::string>&) const;
 	void listEntries(std::vector<const DirEntry*>& result) const;
+	// full path and entry of every stream
+	void listStreams(std::vector< std::pair<std::string, const DirEntry*> >& result) const;
 	ULONG32 small_block_size() const { return (_sbat) ? _sbat->block_size() : 0; }
 	ULONG32 big_block_size() const { return (_bbat) ? _bbat->block_size() : 0; }
-	bool follow_small_block_table( ULONG32 start, std::vector<ULONG32>& chain ) const 
+	bool follow_small_block_table( ULONG32 start, BlockChain& chain ) const 
 	{ 
 		if (_sbat) 
 			return _sbat->follow(start, chain); 
 		return false;
 	}
-	bool follow_big_block_table( ULONG32 start, std::vector<ULONG32>& chain ) const 
+	bool follow_big_block_table( ULONG32 start, BlockChain& chain ) const 
 	{ 
 		if (_bbat) 
 			return _bbat->follow(start, chain); 
 		return false;
 	}
 
-	const std::vector<ULONG32>& sb_blocks() const
+	const BlockChain& sb_blocks() const
 	{
 		return _sb_blocks;
 	}
@@ -92,44 +124,92 @@ public:
 	void leaveDirectory() { return _dirtree->leaveDirectory(); }
 	ULONG32 loadSmallBlock(ULONG32 block, unsigned char* buffer, ULONG32 maxlen);
     ULONG32 loadBigBlock(ULONG32 block, unsigned char* buffer, ULONG32 maxlen);
+	// Read maxlen bytes starting at byte offset pos of the data stored in blocks
+	ULONG32 loadBigBlocks( const BlockChain& blocks, size_t pos, unsigned char* buffer, ULONG32 maxlen );
+	// Tell the device that len bytes at pos of the data in blocks will be read
+	void readahead( const BlockChain& blocks, size_t pos, size_t len );
 	ULONG32 saveBlock(ULONG32 block, const unsigned char* buffer, ULONG32 maxlen);
-	// Delete an entry identified by path, then save changes 
-	// made to the document by calling flush
-	bool delete_entry(const std::string& path) 
-	{ 
-		m_dtmodified = true;
-		if (_dirtree && _dirtree->delete_entry(path)) 
-		{
-			flush();
-			return true; 
-		}
-		return false; 
-	}
-	// Save changes made to the documment
+	// Write len bytes at byte offset pos of the data stored in blocks
+	ULONG32 saveBigBlocks( const BlockChain& blocks, size_t pos, const unsigned char* buffer, ULONG32 len );
+	// Write at most the rest of a small block, from offset
+	ULONG32 saveSmallBlock( ULONG32 block, ULONG32 offset, const unsigned char* buffer, ULONG32 len );
+	// Grow the stream of entry to size bytes, blocks holds its chain and
+	// receives the new one. Streams reaching the threshold are moved from
+	// small to big blocks. Changes are saved by flush.
+	bool resize( const DirEntry* entry, ULONG32 size, BlockChain& blocks );
+	// In transacted mode, move the blocks of entry holding len bytes at pos
+	// to new blocks if the committed storage uses them. Does nothing otherwise.
+	bool copy_on_write( const DirEntry* entry, BlockChain& blocks, size_t pos, size_t len );
+	// Address of a block inside the device memory, NULL if the storage
+	// is not mapped or the block lies past the end of the file.
+	// Small blocks are also found in the preloaded mini stream.
+	const unsigned char* bigBlockData(ULONG32 block, ULONG32 count = 1) const;
+	const unsigned char* smallBlockData(ULONG32 block);
+	// Delete the entry at path with everything below it, free the blocks
+	// of the streams deleted, then save changes by calling flush
+	bool delete_entry( const std::string& path );
+	// Save changes made to the documment, unless transacted
 	void flush();
+	// Save changes made to the document since the last commit, without
+	// changing the blocks the committed storage uses; the new header is
+	// written last, between two flushes of the device
+	bool commit();
+	// Keep the directory, the small block table and the small blocks
+	// container in the cache
+	void pin_metadata();
+	// Read the streams in parallel, in the order of their data in the file
+	bool extract( std::vector<Extraction>& streams, const ExtractCallback& callback, unsigned threads );
 
 // Implementation
 private:  
     void init();
     bool load();
     void close();
+	bool good() const { return _device && _device->good(); }
+	void attach( BlockDevice* device, bool owned );
+	void loadMiniStream();
+	ULONG32 readAt( ULONG32 pos, unsigned char* data, ULONG32 len );
 
-	ULONG32 loadSmallBlocks( const std::vector<ULONG32>& blocks, unsigned char* buffer, ULONG32 maxlen );
-	ULONG32 loadBigBlocks( const std::vector<ULONG32>& blocks, unsigned char* buffer, ULONG32 maxlen );
+	ULONG32 loadSmallBlocks( const BlockChain& blocks, unsigned char* buffer, ULONG32 maxlen );
+	ULONG32 loadBigBlocks( const BlockChain& blocks, unsigned char* buffer, ULONG32 maxlen );
 //	ULONG32 saveBigBlock(ULONG32 fisical_offset, const unsigned char* data, ULONG32 len);
-
-    std::iostream* _stream;
-    std::fstream* _file;
+	bool allocate( AllocTable* table, ULONG32 count, BlockChain& chain );
+	void freeStreamBlocks( const DirEntry* entry );
+	ULONG32 unusedBlock();
+	void release( BlockChain& chain );
+	void protect();
+	bool growMiniStream();
+	bool saveChanges();
+	bool saveAllocTables();
+	bool saveHeader();
+
+	BlockDevice* _device; // where the storage is read from and written to
+	bool _owned;     // _device is deleted on close
 	ULONG32 _size;   // size of the storage stream
     int _result;     // result of last operation
     std::list<StreamImpl*> _streams; // current streams
-    std::vector<ULONG32> _sb_blocks; // blocks for "small" files
+    BlockChain _sb_blocks; // blocks for "small" files
+	bool _preload_mini;    // read all small blocks at once on load
+	bool _mini_loaded;
+	std::vector<unsigned char> _mini_data; // content of the _sb_blocks
+	SectorCache _cache;
+	WorkerPool* _workers;
+	std::mutex _workers_lock;
 	
     Header* _header;           // storage header 
     DirTree* _dirtree;         // directory tree
     AllocTable* _bbat;         // allocation table for big blocks
     AllocTable* _sbat;         // allocation table for small blocks
+	BlockChain _bat_blocks;    // blocks of the big bat
+	BlockChain _mbat_blocks;   // blocks of the meta bat
+	BlockChain _sbat_blocks;   // blocks of the small bat
+	BlockChain _dir_blocks;    // blocks of the directory
 	bool m_dtmodified;
+	bool _bat_modified;        // blocks were allocated since the last flush
+	bool _transacted;
+	unsigned long _chain_changes;
+	std::vector<bool> _committed; // blocks used by the last commit
+	std::vector<bool> _protected; // blocks not to overwrite: used by the last two commits
 
 	// no copy or assign
     StorageIO( const StorageIO& );
@@ -21,6 +21,7 @@
 #pragma once
 
 #include <fstream>
+#include <functional>
 #include <list>
 
 namespace POLE
@@ -32,6 +33,8 @@ class StreamImpl
 {
 public:
 	enum {Eof = 1, Bad = 2};
+	// bounds of the readahead window of big streams
+	enum { MinReadahead = 0x20000, MaxReadahead = 0x800000 };
 	static const std::string null_path;
 
 // Construction/destruction  
@@ -60,7 +63,7 @@ public:
 		}
 		else
 		{
-			_state &= StreamImpl::Eof;
+			_state &= ~StreamImpl::Eof;
 		}
 
 		_pos = pos;
@@ -68,18 +71,29 @@ public:
 
     int getch();
     std::streamsize read( unsigned char* data, std::streamsize maxlen );
+	std::streamsize spans( size_t pos, std::streamsize maxlen, std::vector<Span>& result );
+	// Read at pos without moving the read pointer, thread-safe
+	std::streamsize read_at( size_t pos, unsigned char* data, std::streamsize maxlen ) const;
+	// Same, run by a worker of the storage which then calls done
+	void read_async( size_t pos, unsigned char* data, std::streamsize maxlen, const std::function<void( std::streamsize )>& done ) const;
 
 	POLE::ULONG32 write(const unsigned char* data, POLE::ULONG32 maxlen);
 
 // Implementation
 private:
 	void init();
+	bool follow_blocks();
+	bool follow_blocks( BlockChain& blocks ) const;
+	// follow the chain again if a stream of the storage moved blocks
+	void refresh_blocks() { if (_chains != _io->chain_changes()) follow_blocks(); }
 	std::streamsize read( size_t pos, unsigned char* data, std::streamsize maxlen );
 	void update_cache();
+	void readahead( size_t pos, size_t len );
 
 	StorageIO* _io; 
     const DirEntry* _entry; 
-    std::vector<ULONG32> _blocks;
+    BlockChain _blocks;
+    unsigned long _chains; // chain_changes() of the storage when _blocks was followed
     std::streamsize _pos; // pointer for read
 
 	// simple cache system to speed-up getch()
@@ -88,6 +102,14 @@ private:
     std::streamsize _cache_pos;
 	int _state;
 
+	// sequential reads of big streams are announced to the device
+	size_t _next_read;  // end of the last read
+	size_t _ahead_end;  // data announced up to there
+	size_t _ahead_size; // window, doubles while reading in order
+
+	// data returned by spans() when the storage is not mapped
+	std::vector<unsigned char> _span_data;
+
     // no default, copy or assign
     StreamImpl( );
     StreamImpl& operator=( const StreamImpl& );
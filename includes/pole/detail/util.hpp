@@ -20,6 +20,10 @@
 // util header
 #pragma once
 
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
 namespace POLE
 {
 
@@ -27,9 +31,39 @@ typedef unsigned char ULONG8;
 typedef unsigned short ULONG16;
 typedef unsigned long  ULONG32;
 
+// read-only fragment of stream data, see Stream::spans
+struct Span
+{
+  const unsigned char* data;
+  size_t size;
+};
+
+// stream to read with Storage::extract: with data NULL the content is
+// given to the callback, otherwise up to size bytes are read into data.
+// size is then set to the number of bytes read.
+struct Extraction
+{
+  std::string path;
+  unsigned char* data;
+  unsigned long size;
+};
+
+// true when the host stores integers as the file does (little-endian)
+inline bool hostLittleEndian()
+{
+  const uint16_t probe = 1;
+  return *(const unsigned char*)&probe == 1;
+}
+
+inline uint32_t swapU32( uint32_t data )
+{
+  return (data >> 24) | ((data >> 8) & 0xff00) | ((data << 8) & 0xff0000) | (data << 24);
+}
+
 inline ULONG32 readU32( const unsigned char* ptr )
 {
-  return ptr[0]+(ptr[1]<<8)+(ptr[2]<<16)+(ptr[3]<<24);
+  // widen before shifting, ptr[3]<<24 would overflow int and sign-extend
+  return (ULONG32)ptr[0]+((ULONG32)ptr[1]<<8)+((ULONG32)ptr[2]<<16)+((ULONG32)ptr[3]<<24);
 }
 
 inline void writeU32( unsigned char* ptr, ULONG32 data )
@@ -0,0 +1,69 @@
+/* POLE - Portable C++ library to access OLE Storage
+   Copyright (C) 2002-2004 Ariya Hidayat <ariya@kde.org>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, US
+*/
+
+// workers header
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace POLE
+{
+
+// Fixed set of threads running queued tasks
+class WorkerPool
+{
+// Construction/destruction
+public:
+	// threads 0 starts one worker per core
+	explicit WorkerPool( unsigned threads = 0 );
+	~WorkerPool();
+
+// Attributes
+public:
+	size_t size() const { return _threads.size(); }
+
+// Operations
+public:
+	// Queues task, tasks are started in the order they are posted
+	void post( const std::function<void()>& task );
+	// Waits until every posted task is done
+	void wait();
+
+// Implementation
+private:
+	void run();
+
+	std::vector<std::thread> _threads;
+	std::deque< std::function<void()> > _tasks;
+	std::mutex _lock;
+	std::condition_variable _ready; // a task was posted, or stopping
+	std::condition_variable _idle;  // no task queued or running
+	size_t _running;
+	bool _stop;
+
+	WorkerPool( const WorkerPool& ); // No copy construction
+	WorkerPool& operator=( const WorkerPool& ); // No copy operator
+};
+
+}
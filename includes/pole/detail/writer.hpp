@@ -0,0 +1,106 @@
+/* POLE - Portable C++ library to access OLE Storage
+   Copyright (C) 2002-2004 Ariya Hidayat <ariya@kde.org>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, US
+*/
+
+// writer header
+#pragma once
+
+#include <string>
+#include <vector>
+#include "header.hpp"
+#include "dirtree.hpp"
+#include "alloctable.hpp"
+#include "device.hpp"
+
+namespace POLE
+{
+
+// Writes a new storage in one pass: the data of the streams comes first,
+// one stream after the other, followed by the small-block container, the
+// small bat, the directory and the big bat; the header is written last.
+class WriterIO
+{
+public:
+	enum { Ok, OpenFailed, WriteFailed };
+	// Data is written when this many bytes are pending
+	enum { WriteBufferSize = 0x100000 };
+
+// Construction/destruction
+public:
+	WriterIO( const char* filename );
+#if defined(WIN32)
+	WriterIO( const wchar_t* filename );
+#endif
+	// The device is not owned and must outlive the writer
+	WriterIO( BlockDevice* device );
+	~WriterIO();
+
+// Attributes
+public:
+	int result() const { return _result; }
+	bool closed() const { return _closed; }
+
+// Operations
+public:
+	// Add the stream path with len bytes of data
+	bool add( const std::string& path, const unsigned char* data, ULONG32 len );
+	// Same in several pieces, nothing else is added until close_stream
+	bool open_stream( const std::string& path );
+	bool append( const unsigned char* data, ULONG32 len );
+	bool close_stream();
+	// Add an empty storage
+	bool add_storage( const std::string& path );
+	// Write the tables, the directory and the header
+	bool close();
+
+// Implementation
+private:
+	void init();
+	void attach( BlockDevice* device, bool owned );
+	DirEntry* create( const std::string& path, ULONG8 type );
+	bool output( const unsigned char* data, size_t len );
+	bool pad();
+	bool flush();
+	ULONG32 chain( AllocTable* table, ULONG32 start, ULONG32 count );
+	bool saveMiniStream();
+	bool saveTables();
+
+	BlockDevice* _device; // where the storage is written
+	bool _owned;          // _device is deleted by the writer
+	int _result;
+	bool _closed;
+	Header* _header;
+	DirTree* _dirtree;
+	AllocTable* _bbat;
+	AllocTable* _sbat;
+	ULONG32 _blocks;      // big blocks written or pending
+	ULONG32 _small_blocks; // small blocks in _mini
+	size_t _stream;       // entry of the stream being written, DirTree::None if none
+	ULONG32 _stream_size;
+	ULONG32 _stream_start;  // first big block of the stream
+	ULONG32 _stream_blocks; // big blocks of the stream, 0 while it is small
+	std::vector<unsigned char> _head;    // data of the stream while it is small
+	std::vector<unsigned char> _mini;    // content of the small-block container
+	std::vector<unsigned char> _pending; // data not written yet
+	size_t _written;      // bytes written to the device
+
+	WriterIO( const WriterIO& ); // No copy construction
+	WriterIO& operator=( const WriterIO& ); // No copy operator
+};
+
+}
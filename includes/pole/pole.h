@@ -22,10 +22,14 @@
 
 #pragma once
 
+#include <functional>
+#include <future>
 #include <string>
 #include <list>
+#include <mutex>
 #include <vector>
 #include "./detail/util.hpp"
+#include "./detail/device.hpp"
 
 namespace POLE
 {
@@ -34,17 +38,36 @@ class DirEntry;
 class StorageIO;
 class Stream;
 class StreamImpl;
+class WriterIO;
 
+// A storage can be read from several threads at once, as long as each
+// thread reads its own Stream objects and nothing is written meanwhile.
 class Storage
 {
 public:
   enum { Ok, OpenFailed, NotOLE, BadOLE, UnknownError, StupidWorkaroundForBrokenCompiler=255 };
 
+  // Open modes, may be combined.
+  // MemoryMapped maps the whole file read-only, sector reads are then
+  // served directly from the mapping. Changes can't be saved in this mode.
+  // PreloadMiniStream reads the container of all small streams at once when
+  // the storage is opened, small reads then are memory copies.
+  // Transacted keeps the file as it was until commit is called: changed
+  // sectors are written to free ones and the header is replaced last.
+  // Changes not committed are lost when the storage is closed.
+  enum { ReadWrite = 0, MemoryMapped = 1, PreloadMiniStream = 2, Transacted = 4 };
+
   // Constructs a storage with name filename.
-  Storage( const char* filename );
+  Storage( const char* filename, int mode = ReadWrite );
 #if defined(WIN32)
-  Storage( const wchar_t* filename);
+  Storage( const wchar_t* filename, int mode = ReadWrite );
 #endif
+  // Constructs a storage on device (see detail/device.hpp), which is not
+  // owned and must outlive the storage.
+  Storage( BlockDevice* device, int mode = ReadWrite );
+  // Returns a new read-only storage on len bytes at data, to be deleted by
+  // the caller. The bytes are not copied and must outlive the storage.
+  static Storage* from_memory( const void* data, size_t len );
   // Destroys the storage.
   ~Storage();
 // Attributes
@@ -70,12 +93,51 @@ public:
 
   bool delete_entry(const std::string& path);
 
+  // Saves the directory and the allocation tables changed by writes
+  // to the streams, done anyway when the storage is closed. Does nothing
+  // in Transacted mode.
+  void flush();
+
+  // Saves the changes made since the last commit in Transacted mode, the
+  // file then switches from the old content to the new one at once. The
+  // same as flush otherwise. Returns true if no error occurs.
+  bool commit();
+
+  // Sets how many sectors the cache shared by all streams keeps, 0 disables
+  // it. Only reads of a few sectors go through the cache.
+  void set_cache_size( unsigned long sectors );
+  unsigned long cache_size() const;
+
+  // Number of sector reads served by the cache and read from the file.
+  unsigned long long cache_hits() const;
+  unsigned long long cache_misses() const;
+
+  // Keeps the directory, the small block table and the container of the
+  // small streams in the cache once read, whatever the cache size.
+  void pin_metadata();
+
+  // Called by extract with the content of a stream, possibly from several
+  // threads at once. data is only valid during the call.
+  typedef std::function<void( const std::string& path, const unsigned char* data, unsigned long size )> ExtractCallback;
+
+  // Reads all the streams with threads workers (0: one per core), starting
+  // the reads in the order of their data in the file. Streams without a
+  // buffer are given to callback. Returns false if some path isn't a stream.
+  bool extract( std::vector<Extraction>& streams, const ExtractCallback& callback = ExtractCallback(), unsigned threads = 0 );
+
+  // Same for every stream accepted by filter, given its full path and entry.
+  bool extract( const std::function<bool( const std::string& path, const DirEntry& entry )>& filter,
+    const ExtractCallback& callback, unsigned threads = 0 );
+
   void debug();
   
 private:
   StorageIO* io;
   std::list<Stream*> streams;
+  std::mutex streams_lock;
   
+  explicit Storage( StorageIO* storage_io ): io( storage_io ) {}
+
   // no copy or assign
   Storage( const Storage& );
   Storage& operator=( const Storage& );
@@ -113,9 +175,31 @@ public: // Operations
   // Reads a block of data.
   unsigned long read( unsigned char* data, unsigned long maxlen );
 
+  // Reads a block of data at pos. The read position and state are not
+  // changed, so several threads can read from one stream at once.
+  unsigned long read_at( unsigned long pos, unsigned char* data, unsigned long maxlen ) const;
+
   // Write a block of data
   Stream& write(const unsigned char* data, ULONG32 len);
 
+  // Gets the data between pos and pos+len without copying it, as a list of
+  // fragments, and returns the number of bytes they hold. For memory mapped
+  // storages (and small streams with a preloaded mini stream) the fragments
+  // point into the storage's memory and stay valid as long as the storage;
+  // otherwise they point to a buffer of the stream which is valid until the
+  // next call. The read position is not changed.
+  unsigned long spans( unsigned long pos, unsigned long len, std::vector<Span>& result );
+
+  // Reads up to len bytes at pos into data in the background, on threads
+  // shared by the streams of the storage. The read position is not changed.
+  // data and the stream must stay valid until the read is done; the future
+  // then gives the number of bytes read.
+  std::future<unsigned long> read_async( unsigned long pos, unsigned char* data, unsigned long len );
+
+  // Same, calling done with the number of bytes read from a reading thread.
+  void read_async( unsigned long pos, unsigned char* data, unsigned long len,
+    const std::function<void( unsigned long )>& done );
+
 private:
 	Stream(StreamImpl* i) { impl = i; }
 	~Stream();
@@ -129,6 +213,54 @@ private:
   StreamImpl* impl;
 };
 
+// Builds a new storage from the streams added to it, which can't be read
+// or changed afterwards. The data of each stream is written at once, in
+// consecutive sectors; the tables, the directory and the header follow
+// when the writer is closed.
+class Writer
+{
+public:
+  enum { Ok, OpenFailed, WriteFailed };
+
+  // Creates the file filename, replacing any existing one.
+  Writer( const char* filename );
+#if defined(WIN32)
+  Writer( const wchar_t* filename );
+#endif
+  // Writes to device, which is not owned and must outlive the writer.
+  Writer( BlockDevice* device );
+  // Closes the writer if not done yet.
+  ~Writer();
+
+  // Returns the error code of last operation.
+  int result() const;
+
+  // Adds the stream path (e.g. "/Storage/Stream") with len bytes of data,
+  // creating the storages on the way. Fails if the entry exists already.
+  bool add( const std::string& path, const unsigned char* data, unsigned long len );
+
+  // Adds the empty storage path.
+  bool add_storage( const std::string& path );
+
+  // Starts the stream path, whose data is then given by append in as many
+  // pieces as needed. Only the current piece of a big stream is kept in
+  // memory. Nothing else can be added until close_stream is called.
+  bool open_stream_for_write( const std::string& path );
+  bool append( const unsigned char* data, unsigned long len );
+  bool close_stream();
+
+  // Writes what remains of the storage, closing the current stream if any.
+  // Returns false if some write failed.
+  bool close();
+
+private:
+  WriterIO* io;
+
+  // no copy or assign
+  Writer( const Writer& );
+  Writer& operator=( const Writer& );
+};
+
 
 }
 
@@ -30,11 +30,19 @@
  compound_document can also determine if a given storage or stream path exist through the 
  path_exist method.
  Entry deletion is also possible with delete_entry method.
+ A lazy compound_document lists the entries of a storage the first time the storage
+ is searched or its streams are used, and opens each stream only when
+ stream_path::stream() is called. find_storage and path_exist only list the storages
+ along the path. Child storages reached through sibling iterators are listed as
+ their parent is, but their own children appear once they are searched or their
+ streams are used. begin() lists the whole document since preorder and postorder
+ iterators walk all of it.
 */
 
 // compound_document header
 #pragma once
 #include <string>
+#include <unordered_map>
 #include "pole/detail/util.hpp"
 #include "pole/pole.h"
 #include "path.hpp"
@@ -51,18 +59,28 @@ namespace ole
 		typedef tree<ole::storage_path>::post_order_iterator storage_postorder_iterator;
 		typedef tree<ole::storage_path>::sibling_iterator storage_sibling_iterator;
 		// Construction/destruction
-		compound_document(): _storage(NULL), _good(false) {}
-		compound_document(const std::string& filename);
+		compound_document(): _storage(NULL), _good(false), _lazy(false), _loaded(true), _all_expanded(true) {}
+		// mode is one of the POLE::Storage open modes
+		compound_document(const std::string& filename, int mode = POLE::Storage::ReadWrite, bool lazy = false);
+		compound_document(const char* filename, int mode = POLE::Storage::ReadWrite, bool lazy = false):
+			compound_document(std::string(filename ? filename : ""), mode, lazy) {}
 #if defined(WIN32)
-		compound_document(const std::wstring& filename);
+		compound_document(const std::wstring& filename, int mode = POLE::Storage::ReadWrite, bool lazy = false);
+		compound_document(const wchar_t* filename, int mode = POLE::Storage::ReadWrite, bool lazy = false):
+			compound_document(std::wstring(filename ? filename : L""), mode, lazy) {}
 #endif		
+		// device is not owned and must outlive the document
+		compound_document(POLE::BlockDevice* device, bool lazy = false);
+		// new document read in place from a buffer which must outlive it,
+		// to be deleted by the caller
+		static compound_document* from_memory(const void* data, size_t len, bool lazy = false);
 		~compound_document() { if (_storage) delete _storage; }
 
 	// Attributes
 	public:
 		bool good() const { return _good; }		
-		tree<ole::storage_path>::iterator begin() { return tree<ole::storage_path>::iterator(_storages.begin()); }
-		tree<ole::storage_path>::iterator end() { return tree<ole::storage_path>::iterator(_storages.end()); }
+		tree<ole::storage_path>::iterator begin() { expand_all(); return tree<ole::storage_path>::iterator(_storages.begin()); }
+		tree<ole::storage_path>::iterator end() { load(); return tree<ole::storage_path>::iterator(_storages.end()); }
 		void debug(){_storage->debug();}
 	// Operations
 	public:
@@ -74,32 +92,50 @@ namespace ole
 		// To know if certain paths exist in the compound document
 		bool path_exist(const std::string& path);
 		// Delete an entry in the document bases on a string 
-		bool delete_entry(const std::string& path) 
-		{ 
-			if (_storage && entry_can_be_deleted(path)) 
-				return _storage->delete_entry(path); 
-			return false; 
-		}
+		bool delete_entry(const std::string& path);
 		// Delete an entry in the document bases on an storage iterator
 		bool delete_entry(const ole::compound_document::storage_iterator& entry) 
 		{ return delete_entry(entry->string()); }
 		// Delete an entry in the document bases on an stream iterator
 		bool delete_entry(const ole::storage_path::stream_iterator entry) 
 		{ return delete_entry(entry->string()); }
+		// Save the changes made by writing to the streams
+		void flush() { if (_storage) _storage->flush(); }
+		// Save the changes of a document opened in Transacted mode
+		bool commit() { return _storage ? _storage->commit() : false; }
+		// Read many streams in parallel, see POLE::Storage::extract
+		bool extract(std::vector<POLE::Extraction>& streams, const POLE::Storage::ExtractCallback& callback = POLE::Storage::ExtractCallback(), unsigned threads = 0)
+		{ return _storage ? _storage->extract(streams, callback, threads) : false; }
+		bool extract(const std::function<bool(const std::string&, const POLE::DirEntry&)>& filter, const POLE::Storage::ExtractCallback& callback, unsigned threads = 0)
+		{ return _storage ? _storage->extract(filter, callback, threads) : false; }
 		
 
 	// Implementation
 	private:
+		// takes storage over
+		compound_document(POLE::Storage* storage, bool lazy);
+		friend class ole::storage_path; // To list its entries
+
 		void init();
+		void load() { if (!_loaded) init(); }
+		// List the child storages and streams of storage
+		void expand(ole::storage_path& storage);
+		void expand_all();
 		void listEntries(std::vector<const POLE::DirEntry*>& result)
 		{ if (_storage) _storage->listEntries(result); }
 		// Determines if an entry identified by path can be deleted
 		// A stream should not be deleted if there is a stream using it
 		bool entry_can_be_deleted(const std::string& path);
+		// Remove a deleted entry from the tree of storages
+		void forget_entry(const std::string& path);
 
 		POLE::Storage* _storage;
 		tree<ole::storage_path> _storages;
+		std::unordered_map<std::string, tree<ole::storage_path>::iterator> _storage_index; // path to node in _storages
 		bool _good;
+		bool _lazy;   // streams are opened on demand
+		bool _loaded; // the root storage is in _storages
+		bool _all_expanded; // every storage has listed its entries
 
 		ole::compound_document& operator=(const ole::compound_document&); // no assignment operator
 	};
@@ -110,4 +146,10 @@ namespace ole
 	typedef tree<ole::storage_path>::iterator storage_iterator; 
 	typedef ole::compound_document::storage_sibling_iterator storage_sibling_iterator;
 	typedef ole::storage_path::stream_iterator stream_iterator;
+
+	inline void storage_path::expand()
+	{
+		if (!_expanded && _document)
+			_document->expand(*this);
+	}
 }
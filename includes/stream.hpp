@@ -43,6 +43,26 @@ namespace ole
 	// Operations
 	public:
 		std::streamsize read(char* buf, std::streamsize n) { return _stream ? _stream->read((unsigned char *)buf, (unsigned long)n): 0; }
+		// Read n bytes at pos, leaving the position alone. See POLE::Stream::read_at
+		std::streamsize read_at(std::streamoff pos, char* buf, std::streamsize n) const
+		{ return _stream ? _stream->read_at((unsigned long)pos, (unsigned char *)buf, (unsigned long)n) : 0; }
+		// Fragments of the data between pos and pos+n, without copying it. See POLE::Stream::spans
+		std::streamsize spans(std::streamoff pos, std::streamsize n, std::vector<POLE::Span>& result) 
+		{ 
+			if (!_stream) { result.clear(); return 0; }
+			return _stream->spans((unsigned long)pos, (unsigned long)n, result); 
+		}
+		// Read n bytes at pos in the background. See POLE::Stream::read_async
+		std::future<unsigned long> read_async(std::streamoff pos, char* buf, std::streamsize n)
+		{
+			if (!_stream) { std::promise<unsigned long> none; none.set_value(0); return none.get_future(); }
+			return _stream->read_async((unsigned long)pos, (unsigned char*)buf, (unsigned long)n);
+		}
+		void read_async(std::streamoff pos, char* buf, std::streamsize n, const std::function<void(unsigned long)>& done)
+		{
+			if (!_stream) { if (done) done(0); return; }
+			_stream->read_async((unsigned long)pos, (unsigned char*)buf, (unsigned long)n, done);
+		}
 		ole::basic_stream& write(const char* buf, std::streamsize n) { _stream->write((unsigned char *)buf, (POLE::ULONG32)n); return *this; }
 		ole::basic_stream& operator=( const ole::basic_stream& other ) { _stream = other._stream; return *this; }
 		std::streamoff seek(std::streamoff off, std::ios::seekdir way, std::ios::openmode which = std::ios::in) 
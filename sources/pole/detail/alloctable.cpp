@@ -19,13 +19,54 @@
 
 
 #include <iostream>
+#include <string.h>
+#include <algorithm>
 #include "../../../includes/pole/detail/util.hpp"
 #include "../../../includes/pole/detail/alloctable.hpp"
 
 namespace POLE
 {
 
+// =========== BlockChain ==========
 
+void BlockChain::push_back( ULONG32 block )
+{
+  if( _extents.size() )
+  {
+    Extent& last = _extents.back();
+    if( last.start + last.length == block )
+    {
+      last.length++;
+      _count++;
+      return;
+    }
+  }
+
+  Extent e = { (uint32_t)block, 1, (uint32_t)_count };
+  _extents.push_back( e );
+  _count++;
+}
+
+size_t BlockChain::find( size_t index ) const
+{
+  // binary search for the last extent starting at or before index
+  size_t lo = 0, hi = _extents.size();
+  while( hi - lo > 1 )
+  {
+    size_t mid = lo + ( hi - lo ) / 2;
+    if( _extents[mid].offset <= index )
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+ULONG32 BlockChain::operator[]( size_t index ) const
+{
+  const Extent& e = _extents[ find( index ) ];
+  return e.start + (ULONG32)( index - e.offset );
+}
  
 // =========== AllocTable ==========
 
@@ -39,7 +80,27 @@ void AllocTable::set( size_t index, ULONG32 value )
 {
   if ( index >= count() )
 	  resize( index + 1);
-  _data[ index ] = value;
+  _data[ index ] = (uint32_t)value;
+  _dirty[ index ] = true;
+  if( value == Avail && index < _first_free )
+    _first_free = index;
+}
+
+size_t AllocTable::release( ULONG32 start )
+{
+  std::vector<ULONG32> chain;
+  follow( start, chain );
+  for( size_t i = 0; i < chain.size(); i++ )
+    set( chain[i], Avail );
+  return chain.size();
+}
+
+bool AllocTable::modified( size_t first, size_t count ) const
+{
+  for( size_t i = first; ( i < first + count ) && ( i < _dirty.size() ); i++ )
+    if( _dirty[i] )
+      return true;
+  return false;
 }
 
 void AllocTable::set_chain( const std::vector<ULONG32>& chain )
@@ -76,16 +137,54 @@ bool AllocTable::follow( ULONG32 start, std::vector<ULONG32>& chain ) const
   return result;
 }
 
-size_t AllocTable::unused()
+bool AllocTable::follow( ULONG32 start, BlockChain& chain ) const
+{
+  if( start >= count() ) 
+	  return false; 
+
+  bool result = true;
+  ULONG32 p = start;
+  size_t loop_control = 0;
+  while( p < count() )
+  {
+    if (!(loop_control < count()))
+	{
+		result = false;
+		break;
+	}
+    chain.push_back( p );
+    p = _data[ p ];
+	++loop_control;
+  }
+
+  return result;
+}
+
+bool AllocTable::unused_before( size_t n ) const
+{
+  for( size_t i = _first_free; ( i < n ) && ( i < _data.size() ); i++ )
+    if( _data[i] == Avail )
+      return true;
+  return false;
+}
+
+size_t AllocTable::unused( size_t from )
 {
-  // find first available block
-  for( size_t i = 0; i < _data.size(); i++ )
+  // find first available block, the scan starts at the first one
+  // that may be free and moves it on
+  for( size_t i = std::max( from, _first_free ); i < _data.size(); i++ )
     if( _data[i] == Avail )
+    {
+      if( from <= _first_free )
+        _first_free = i;
       return i;
+    }
   
   // completely full, so enlarge the table
-  size_t block = _data.size();
-  resize( _data.size() + 10 );
+  size_t block = std::max( from, _data.size() );
+  if( from <= _first_free )
+    _first_free = block;
+  resize( block + 10 );
   return block;      
 }
 
@@ -94,9 +193,16 @@ bool AllocTable::load( const unsigned char* buffer, size_t len )
   if (len%4 || !buffer)
     return false;
 
-  resize( len / 4 );
-  for( size_t i = 0; i < count(); i++ )
-    set( i, readU32( buffer + i*4 ) );
+  // the table has the on-disk layout, copy it at once
+  _data.resize( len / 4 );
+  _dirty.assign( _data.size(), false );
+  _first_free = 0;
+  if( _data.empty() )
+    return true;
+  memcpy( &_data[0], buffer, len );
+  if( !hostLittleEndian() )
+    for( size_t i = 0; i < _data.size(); i++ )
+      _data[i] = swapU32( _data[i] );
   
   return true;
 }
@@ -106,8 +212,13 @@ bool AllocTable::save( unsigned char* buffer, size_t len )
   if (len < 4*count() || !buffer)
 	  return false;
 
-  for( size_t i = 0; i < count(); i++ )
-    writeU32( buffer + i*4, _data[i] );
+  if( _data.empty() )
+    return true;
+  if( hostLittleEndian() )
+    memcpy( buffer, &_data[0], 4*count() );
+  else
+    for( size_t i = 0; i < count(); i++ )
+      writeU32( buffer + i*4, _data[i] );
 
   return true;
 }
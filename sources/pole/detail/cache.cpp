@@ -0,0 +1,174 @@
+/* POLE - Portable C++ library to access OLE Storage
+   Copyright (C) 2002-2004 Ariya Hidayat <ariya@kde.org>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, US
+*/
+
+
+#include <string.h>
+#include "../../../includes/pole/detail/cache.hpp"
+
+namespace POLE
+{
+
+// =========== SectorCache ==========
+
+size_t SectorCache::size() const
+{
+	std::lock_guard<std::mutex> guard( _lock );
+	return _slots.size();
+}
+
+unsigned long long SectorCache::hits() const
+{
+	std::lock_guard<std::mutex> guard( _lock );
+	return _hits;
+}
+
+unsigned long long SectorCache::misses() const
+{
+	std::lock_guard<std::mutex> guard( _lock );
+	return _misses;
+}
+
+void SectorCache::set_sector_size( size_t size )
+{
+	std::lock_guard<std::mutex> guard( _lock );
+	if (size == _sector_size)
+		return;
+	_sector_size = size;
+	_slots.clear();
+	_lru.clear();
+}
+
+void SectorCache::set_capacity( size_t sectors )
+{
+	std::lock_guard<std::mutex> guard( _lock );
+	_capacity = sectors;
+	evict();
+}
+
+bool SectorCache::get( size_t sector, size_t offset, unsigned char* data, size_t len )
+{
+	std::lock_guard<std::mutex> guard( _lock );
+	std::unordered_map<size_t, Slot>::iterator it = _slots.find( sector );
+	if (it == _slots.end() || offset + len > it->second.data.size())
+	{
+		_misses++;
+		return false;
+	}
+	_hits++;
+	if (!it->second.pinned)
+		_lru.splice( _lru.begin(), _lru, it->second.lru );
+	memcpy( data, &it->second.data[offset], len );
+	return true;
+}
+
+void SectorCache::put( size_t sector, const unsigned char* data, size_t size )
+{
+	std::lock_guard<std::mutex> guard( _lock );
+	std::unordered_map<size_t, Slot>::iterator it = _slots.find( sector );
+	if (it == _slots.end())
+	{
+		if (_capacity == 0)
+			return;
+		Slot& slot = _slots[sector];
+		slot.pinned = false;
+		_lru.push_front( sector );
+		slot.lru = _lru.begin();
+		it = _slots.find( sector );
+	}
+	else if (!it->second.pinned)
+		_lru.splice( _lru.begin(), _lru, it->second.lru );
+	it->second.data.assign( data, data + size );
+	evict();
+}
+
+void SectorCache::pin( size_t sector, bool pinned )
+{
+	std::lock_guard<std::mutex> guard( _lock );
+	std::unordered_map<size_t, Slot>::iterator it = _slots.find( sector );
+	if (it == _slots.end())
+	{
+		// an empty slot, filled by the next put
+		if (!pinned)
+			return;
+		_slots[sector].pinned = true;
+		return;
+	}
+	if (it->second.pinned == pinned)
+		return;
+	it->second.pinned = pinned;
+	if (pinned)
+		_lru.erase( it->second.lru );
+	else
+	{
+		_lru.push_front( sector );
+		it->second.lru = _lru.begin();
+		evict();
+	}
+}
+
+bool SectorCache::pinned( size_t sector ) const
+{
+	std::lock_guard<std::mutex> guard( _lock );
+	std::unordered_map<size_t, Slot>::const_iterator it = _slots.find( sector );
+	return it != _slots.end() && it->second.pinned;
+}
+
+void SectorCache::write( size_t pos, const unsigned char* data, size_t len )
+{
+	std::lock_guard<std::mutex> guard( _lock );
+	if (_slots.empty() || len == 0)
+		return;
+	for (size_t sector = pos / _sector_size; sector * _sector_size < pos + len; sector++)
+	{
+		std::unordered_map<size_t, Slot>::iterator it = _slots.find( sector );
+		if (it == _slots.end())
+			continue;
+		std::vector<unsigned char>& cached = it->second.data;
+		size_t first = sector * _sector_size;
+		size_t from = ( pos > first ) ? pos : first;
+		size_t to = ( pos + len < first + _sector_size ) ? pos + len : first + _sector_size;
+		if (to - first > cached.size())
+		{
+			// the file grew over a partial last sector
+			if (from - first > cached.size())
+				continue;
+			cached.resize( to - first );
+		}
+		memcpy( &cached[from - first], data + ( from - pos ), to - from );
+	}
+}
+
+void SectorCache::clear()
+{
+	std::lock_guard<std::mutex> guard( _lock );
+	_slots.clear();
+	_lru.clear();
+}
+
+// drop least recently used sectors over capacity, lock held
+void SectorCache::evict()
+{
+	while (_lru.size() > _capacity)
+	{
+		_slots.erase( _lru.back() );
+		_lru.pop_back();
+	}
+}
+
+}
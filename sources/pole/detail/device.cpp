@@ -0,0 +1,448 @@
+/* POLE - Portable C++ library to access OLE Storage
+   Copyright (C) 2002-2004 Ariya Hidayat <ariya@kde.org>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, US
+*/
+
+
+#include <cstring>
+#include <fstream>
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "../../../includes/pole/detail/device.hpp"
+
+namespace POLE
+{
+
+// =========== StreamDevice ==========
+
+StreamDevice::StreamDevice(): _stream(NULL), _owned(false), _size(0)
+{
+}
+
+StreamDevice::StreamDevice( std::iostream* stream ): _stream(stream), _owned(false), _size(0)
+{
+	if (!_stream)
+		return;
+	_stream->seekg( 0, std::ios::end );
+	std::streamoff end = _stream->tellg();
+	_size = (end > 0) ? (size_t)end : 0;
+}
+
+bool StreamDevice::good() const
+{
+	return _stream && _stream->good();
+}
+
+bool StreamDevice::open( const char* filename, bool create )
+{
+	close();
+	std::ios::openmode mode = std::ios::binary | std::ios::in | std::ios::out;
+	if (create)
+		mode |= std::ios::trunc;
+	std::fstream* file = new std::fstream( filename, mode );
+	if (file->fail())
+	{
+		delete file;
+		return false;
+	}
+	_stream = file;
+	_owned = true;
+	_stream->seekg( 0, std::ios::end );
+	std::streamoff end = _stream->tellg();
+	_size = (end > 0) ? (size_t)end : 0;
+	return true;
+}
+
+void StreamDevice::close()
+{
+	if (_owned)
+		delete _stream;
+	_stream = NULL;
+	_owned = false;
+	_size = 0;
+}
+
+size_t StreamDevice::read_at( size_t pos, unsigned char* buffer, size_t len )
+{
+	std::lock_guard<std::mutex> guard( _lock );
+	if (!good() || pos >= _size)
+		return 0;
+	if (len > _size - pos)
+		len = _size - pos;
+	_stream->seekg( pos );
+	_stream->read( (char*)buffer, len );
+	return (size_t)_stream->gcount();
+}
+
+size_t StreamDevice::write_at( size_t pos, const unsigned char* buffer, size_t len )
+{
+	std::lock_guard<std::mutex> guard( _lock );
+	if (!good())
+		return 0;
+	_stream->seekp( pos );
+	_stream->write( (const char*)buffer, len );
+	if (!_stream->good())
+		return 0;
+	if (pos + len > _size)
+		_size = pos + len;
+	return len;
+}
+
+bool StreamDevice::flush()
+{
+	std::lock_guard<std::mutex> guard( _lock );
+	if (!good())
+		return false;
+	_stream->flush();
+	return _stream->good();
+}
+
+// =========== FileDevice ==========
+
+#if defined(WIN32)
+
+FileDevice::FileDevice(): _file(NULL), _valid(false), _writable(false), _unsynced(false), _size(0)
+{
+}
+
+bool FileDevice::open( const char* filename, bool create )
+{
+	close();
+	DWORD disposition = create ? CREATE_ALWAYS : OPEN_EXISTING;
+	HANDLE file = CreateFileA( filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, disposition, FILE_ATTRIBUTE_NORMAL, NULL );
+	if (file != INVALID_HANDLE_VALUE || create)
+		return attach( file, true );
+	file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	return attach( file, false );
+}
+
+bool FileDevice::open( const wchar_t* filename, bool create )
+{
+	close();
+	DWORD disposition = create ? CREATE_ALWAYS : OPEN_EXISTING;
+	HANDLE file = CreateFileW( filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, disposition, FILE_ATTRIBUTE_NORMAL, NULL );
+	if (file != INVALID_HANDLE_VALUE || create)
+		return attach( file, true );
+	file = CreateFileW( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	return attach( file, false );
+}
+
+bool FileDevice::attach( void* file, bool writable )
+{
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx( (HANDLE)file, &size ))
+	{
+		CloseHandle( (HANDLE)file );
+		return false;
+	}
+	_file = file;
+	_valid = true;
+	_writable = writable;
+	_size = (size_t)size.QuadPart;
+	return true;
+}
+
+void FileDevice::close()
+{
+	if (_file)
+		CloseHandle( (HANDLE)_file );
+	_file = NULL;
+	_valid = false;
+	_writable = false;
+	_unsynced = false;
+	_size = 0;
+}
+
+// the offset is given with each call, the file pointer is not used
+size_t FileDevice::read_at( size_t pos, unsigned char* buffer, size_t len )
+{
+	if (!_valid || pos >= _size)
+		return 0;
+	if (len > _size - pos)
+		len = _size - pos;
+	size_t bytes = 0;
+	while (bytes < len)
+	{
+		OVERLAPPED at = {};
+		at.Offset = (DWORD)(pos + bytes);
+		at.OffsetHigh = (DWORD)((unsigned long long)(pos + bytes) >> 32);
+		DWORD chunk = (len - bytes > 0x40000000) ? 0x40000000 : (DWORD)(len - bytes);
+		DWORD read = 0;
+		if (!ReadFile( (HANDLE)_file, buffer + bytes, chunk, &read, &at ) || read == 0)
+			break;
+		bytes += read;
+	}
+	return bytes;
+}
+
+size_t FileDevice::write_at( size_t pos, const unsigned char* buffer, size_t len )
+{
+	if (!writable())
+		return 0;
+	size_t bytes = 0;
+	while (bytes < len)
+	{
+		OVERLAPPED at = {};
+		at.Offset = (DWORD)(pos + bytes);
+		at.OffsetHigh = (DWORD)((unsigned long long)(pos + bytes) >> 32);
+		DWORD chunk = (len - bytes > 0x40000000) ? 0x40000000 : (DWORD)(len - bytes);
+		DWORD written = 0;
+		if (!WriteFile( (HANDLE)_file, buffer + bytes, chunk, &written, &at ) || written == 0)
+			break;
+		bytes += written;
+	}
+	if (pos + bytes > _size)
+		_size = pos + bytes;
+	if (bytes > 0)
+		_unsynced = true;
+	return bytes;
+}
+
+// writes are not buffered here
+bool FileDevice::flush()
+{
+	return _valid;
+}
+
+// but by the system: wait until they reached the disk
+bool FileDevice::sync()
+{
+	if (!_valid)
+		return false;
+	if (!_unsynced)
+		return true;
+	if (!FlushFileBuffers( (HANDLE)_file ))
+		return false;
+	_unsynced = false;
+	return true;
+}
+
+bool FileDevice::truncate( size_t size )
+{
+	if (!writable())
+		return false;
+	LARGE_INTEGER at;
+	at.QuadPart = (LONGLONG)size;
+	if (!SetFilePointerEx( (HANDLE)_file, at, NULL, FILE_BEGIN ) || !SetEndOfFile( (HANDLE)_file ))
+		return false;
+	_size = size;
+	_unsynced = true;
+	return true;
+}
+
+void FileDevice::advise( size_t, size_t )
+{
+}
+
+#else
+
+FileDevice::FileDevice(): _fd(-1), _valid(false), _writable(false), _unsynced(false), _size(0)
+{
+}
+
+bool FileDevice::open( const char* filename, bool create )
+{
+	close();
+	int fd = create ? ::open( filename, O_RDWR | O_CREAT | O_TRUNC, 0666 ) : ::open( filename, O_RDWR );
+	_writable = (fd >= 0);
+	if (fd < 0 && !create)
+		fd = ::open( filename, O_RDONLY );
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat( fd, &st ) != 0)
+	{
+		::close( fd );
+		_writable = false;
+		return false;
+	}
+	_fd = fd;
+	_valid = true;
+	_size = (size_t)st.st_size;
+	return true;
+}
+
+void FileDevice::close()
+{
+	if (_fd >= 0)
+		::close( _fd );
+	_fd = -1;
+	_valid = false;
+	_writable = false;
+	_unsynced = false;
+	_size = 0;
+}
+
+// the offset is given with each call, the file position is not used
+size_t FileDevice::read_at( size_t pos, unsigned char* buffer, size_t len )
+{
+	if (!_valid || pos >= _size)
+		return 0;
+	if (len > _size - pos)
+		len = _size - pos;
+	size_t bytes = 0;
+	while (bytes < len)
+	{
+		ssize_t read = ::pread( _fd, buffer + bytes, len - bytes, (off_t)(pos + bytes) );
+		if (read <= 0)
+			break;
+		bytes += (size_t)read;
+	}
+	return bytes;
+}
+
+size_t FileDevice::write_at( size_t pos, const unsigned char* buffer, size_t len )
+{
+	if (!writable())
+		return 0;
+	size_t bytes = 0;
+	while (bytes < len)
+	{
+		ssize_t written = ::pwrite( _fd, buffer + bytes, len - bytes, (off_t)(pos + bytes) );
+		if (written <= 0)
+			break;
+		bytes += (size_t)written;
+	}
+	if (pos + bytes > _size)
+		_size = pos + bytes;
+	if (bytes > 0)
+		_unsynced = true;
+	return bytes;
+}
+
+// writes are not buffered here
+bool FileDevice::flush()
+{
+	return _valid;
+}
+
+// but by the system: wait until they reached the disk
+bool FileDevice::sync()
+{
+	if (!_valid)
+		return false;
+	if (!_unsynced)
+		return true;
+#if defined(__APPLE__)
+	if (::fsync( _fd ) != 0)
+#else
+	if (::fdatasync( _fd ) != 0)
+#endif
+		return false;
+	_unsynced = false;
+	return true;
+}
+
+bool FileDevice::truncate( size_t size )
+{
+	if (!writable() || ::ftruncate( _fd, (off_t)size ) != 0)
+		return false;
+	_size = size;
+	_unsynced = true;
+	return true;
+}
+
+// let the kernel read ahead in the background
+void FileDevice::advise( size_t pos, size_t len )
+{
+#if defined(POSIX_FADV_WILLNEED)
+	if (_valid && len > 0)
+		posix_fadvise( _fd, (off_t)pos, (off_t)len, POSIX_FADV_WILLNEED );
+#endif
+}
+
+#endif
+
+// =========== MappedDevice ==========
+
+size_t MappedDevice::read_at( size_t pos, unsigned char* buffer, size_t len )
+{
+	if (pos >= _map.size())
+		return 0;
+	if (len > _map.size() - pos)
+		len = _map.size() - pos;
+	memcpy( buffer, _map.data() + pos, len );
+	return len;
+}
+
+// page in the range before it is touched
+void MappedDevice::advise( size_t pos, size_t len )
+{
+#if !defined(WIN32) && defined(MADV_WILLNEED)
+	if (pos >= _map.size() || len == 0)
+		return;
+	if (len > _map.size() - pos)
+		len = _map.size() - pos;
+	size_t page = (size_t)sysconf( _SC_PAGESIZE );
+	size_t start = pos - pos % page;
+	madvise( (void*)( _map.data() + start ), len + ( pos - start ), MADV_WILLNEED );
+#else
+	(void)pos;
+	(void)len;
+#endif
+}
+
+// =========== MemoryDevice ==========
+
+const unsigned char* MemoryDevice::data() const
+{
+	if (_view)
+		return _view;
+	return _buffer.empty() ? NULL : &_buffer[0];
+}
+
+size_t MemoryDevice::read_at( size_t pos, unsigned char* buffer, size_t len )
+{
+	if (pos >= _size)
+		return 0;
+	if (len > _size - pos)
+		len = _size - pos;
+	memcpy( buffer, data() + pos, len );
+	return len;
+}
+
+size_t MemoryDevice::write_at( size_t pos, const unsigned char* buffer, size_t len )
+{
+	if (!writable())
+		return 0;
+	if (pos + len > _buffer.size())
+		_buffer.resize( pos + len );
+	memcpy( &_buffer[pos], buffer, len );
+	_size = _buffer.size();
+	return len;
+}
+
+bool MemoryDevice::truncate( size_t size )
+{
+	if (!writable())
+		return false;
+	if (size < _buffer.size())
+		_buffer.resize( size );
+	_size = _buffer.size();
+	return true;
+}
+
+}
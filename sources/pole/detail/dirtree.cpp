@@ -18,6 +18,7 @@
 */
 
 
+#include <algorithm>
 #include <list>
 #include <iostream>
 #include <string.h>
@@ -43,10 +44,15 @@ bool DirEntry::valid() const
 
 // =========== DirTree ==========
 
+const size_t DirTree::None = (size_t)-1;
+
 void DirTree::clear()
 {
   // leave only the root entry
   _entries.resize( 1 );
+  _parents.assign( 1, None );
+  _unsorted.clear();
+  invalidate_paths();
   _current = 0;
 }
 
@@ -70,23 +76,21 @@ size_t DirTree::indexOf( const DirEntry* e ) const
   return -1;
 }
 
-size_t DirTree::parent( size_t index ) const
+// index the parent of every entry, so that parent() doesn't have to
+// search the whole tree. If an entry is reachable from several entries
+// (broken file) the first one wins.
+void DirTree::build_parents()
 {
-	// brute-force, basically we iterate for each entries, find its children
-	// and check if one of the children is 'index'
+	_parents.assign( entryCount(), None );
+	std::vector<bool> visited( entryCount(), false );
 	for( size_t j = 0; j < entryCount(); j++ )
 	{
-		/*DirEntry e = _entries[j];
-		if (e.child() == index)
-			return j;*/
 		std::vector<size_t> chi;
-		children( j, chi );
+		children( j, chi, visited );
 		for( size_t i=0; i<chi.size();i++ )
-		if( chi[i] == index )
-			return j;
+			if( _parents[ chi[i] ] == None )
+				_parents[ chi[i] ] = j;
 	}
-	        
-	return -1;
 }
 
 void DirTree::fullName( size_t index, std::string& result ) const
@@ -104,7 +108,10 @@ void DirTree::fullName( size_t index, std::string& result ) const
 	if (p == -1)
 		return;
 	const DirEntry * _entry = 0;
-	while( p > 0 )
+	// a path can't be deeper than the number of entries, unless the
+	// parents form a loop
+	size_t depth = 0;
+	while( p > 0 && depth++ < entryCount() )
 	{
 		_entry = entry( p );
 		if (_entry && _entry->dir() && _entry->valid())
@@ -145,56 +152,167 @@ DirEntry* DirTree::_entry( const std::string& name, bool create )
      start = end+1;
    }
   
+   // look the full path up, relative names start at current directory
+   if( !_paths_valid )
+     build_paths();
+   std::string key;
+   if( name[0] != '/' && _current != 0 )
+     fullName( _current, key );
+   std::list<std::string>::const_iterator nit;
+   for( nit = names.begin(); nit != names.end(); ++nit )
+     key.append( 1, '/' ).append( *nit );
+   std::unordered_map<std::string, size_t>::const_iterator found = _paths.find( key );
+   if( found != _paths.end() )
+     return _entry( found->second );
+   if( !create ) return NULL;
+
    // start from root when name is absolute
    // or current directory when name is relative
    size_t index = (name[0] == '/' ) ? 0 : _current;
+   std::string walked;
+   if( index != 0 )
+     fullName( index, walked );
 
    // trace one by one   
    std::list<std::string>::iterator it; 
    for( it = names.begin(); it != names.end(); ++it )
    {
+     walked.append( 1, '/' ).append( *it );
+
      // find among the children of index
-     std::vector<size_t> chi;
-	 children( index, chi );
-     size_t child = 0;
-     for( size_t i = 0; i < chi.size(); i++ )
-     {
-       const DirEntry* ce = entry( chi[i] );
-       if( ce ) 
-         if( ce->valid() && ( ce->name().length()>1 ) )
-		 {
-           if( ce->name() == *it )
-		   {
-             child = chi[i];
-			 break;
-		   }
-		 }
-     }
+     size_t child = find_child( index, *it );
      
      // traverse to the child
-     if( child > 0 ) index = child;
+     if( child != None ) index = child;
      else
      {
        // not found among children
        if( !create ) return NULL;
        
-       // create a new entry
-       DirEntry* parent = &_entries[index];
-	   DirEntry e(*it, (ULONG16)(((*it).size()*2) + 2), 2, 0, 0, DirEntry::End, DirEntry::End, parent->child(), entryCount() + 1);
+       // create a new entry, linked before the existing children
+       size_t parent = index;
+	   // the last name is the stream, the others storages
+	   std::list<std::string>::iterator last = it;
+	   ULONG8 type = ( ++last == names.end() ) ? 2 : 1;
+	   DirEntry e(*it, (ULONG16)(((*it).size()*2) + 2), type, 0, DirEntry::End, DirEntry::End, DirEntry::End, DirEntry::End, entryCount(), true);
 	   _entries.push_back( e );
+       _parents.push_back( parent );
        index = entryCount()-1;
-       parent->set_child((ULONG32)index);
+       insert_child( parent, index );
+       // the new entry is the only one with its path
+       if( _paths_valid && ( it->length() > 1 ) )
+         _paths[ walked ] = index;
      }
    }
 
+   // keep later lookups read-only
+   if( !_paths_valid )
+     build_paths();
    return _entry( index );
 }
 
+// map the full path of every reachable entry to its index, following
+// the same rules as the walk in _entry: the first child with a given
+// name wins, and invalid or one-character names are skipped
+void DirTree::build_paths()
+{
+  _paths.clear();
+  std::vector<bool> visited( entryCount(), false );
+  std::vector<bool> siblings( entryCount(), false );
+  std::vector< std::pair<size_t, std::string> > pending;
+  pending.push_back( std::make_pair( (size_t)0, std::string() ) );
+  visited[0] = true;
+  while( !pending.empty() )
+  {
+    size_t index = pending.back().first;
+    std::string path = pending.back().second;
+    pending.pop_back();
+
+    std::vector<size_t> chi;
+    children( index, chi, siblings );
+    for( size_t i = 0; i < chi.size(); i++ )
+    {
+      const DirEntry* ce = entry( chi[i] );
+      if( !ce || !ce->valid() || ( ce->name().length() <= 1 ) )
+        continue;
+      std::string key = path + "/" + ce->name();
+      if( !_paths.insert( std::make_pair( key, chi[i] ) ).second )
+        continue;
+      if( !visited[ chi[i] ] )
+      {
+        visited[ chi[i] ] = true;
+        pending.push_back( std::make_pair( chi[i], key ) );
+      }
+    }
+  }
+  _paths_valid = true;
+}
+
+// siblings are ordered by name length first, then by upper-cased name
+int DirEntry::compare_names( const std::string& a, const std::string& b )
+{
+  if( a.length() != b.length() )
+    return ( a.length() < b.length() ) ? -1 : 1;
+  for( size_t i = 0; i < a.length(); i++ )
+  {
+    unsigned char ca = a[i], cb = b[i];
+    if( ca >= 'a' && ca <= 'z' ) ca -= 'a' - 'A';
+    if( cb >= 'a' && cb <= 'z' ) cb -= 'a' - 'A';
+    if( ca != cb )
+      return ( ca < cb ) ? -1 : 1;
+  }
+  return 0;
+}
+
+// find the child of index called name, None if there is none
+size_t DirTree::find_child( size_t index, const std::string& name ) const
+{
+  const DirEntry* e = entry( index );
+  if( !e || !e->valid() )
+    return None;
+
+  // descend the red-black tree the siblings are stored in
+  ULONG32 node = e->child();
+  for( size_t steps = 0; ( node > 0 ) && ( node < entryCount() ) && ( steps < entryCount() ); steps++ )
+  {
+    const DirEntry* ce = entry( node );
+    if( !ce->valid() )
+      break;
+    int cmp = DirEntry::compare_names( name, ce->name() );
+    if( cmp == 0 )
+    {
+      if( ( ce->name() == name ) && ( ce->name().length()>1 ) )
+        return node;
+      break;
+    }
+    node = ( cmp < 0 ) ? ce->prev() : ce->next();
+  }
+
+  // not there, unless the siblings are not sorted: check them all
+  if( ( index >= _unsorted.size() ) || !_unsorted[index] )
+    return None;
+  std::vector<size_t> chi;
+  children( index, chi );
+  for( size_t i = 0; i < chi.size(); i++ )
+  {
+    const DirEntry* ce = entry( chi[i] );
+    if( ce && ce->valid() && ( ce->name().length()>1 ) && ( ce->name() == name ) )
+      return chi[i];
+  }
+  return None;
+}
+
 void DirTree::children( size_t index, std::vector<size_t>& result ) const
+{ 
+  std::vector<bool> visited( entryCount(), false );
+  children( index, result, visited );
+}
+
+void DirTree::children( size_t index, std::vector<size_t>& result, std::vector<bool>& visited ) const
 { 
   const DirEntry* e = entry( index );
   if( e && ( e->valid() && e->child() < entryCount() ) )
-    find_siblings( result, e->child() );
+    find_siblings( result, e->child(), visited );
 }
 
 void DirTree::listDirectory(std::vector<const DirEntry*>& result) const
@@ -270,26 +388,41 @@ bool DirTree::load( unsigned char* buffer, size_t size )
     ULONG32 child = readU32( buffer + 0x4C+p );
     
 	DirEntry e(name, len, type, size, start, prev, next, child, _entries.size());
+	e.set_color( buffer[ 0x43 + p ] );
+	e.set_modif( false );
 
 	_entries.push_back( e );
 	
   }  
+  build_parents();
+  check_sorted();
+  invalidate_paths();
+  // lookups don't modify the tree once the index is built
+  build_paths();
   return true;
 }
 
 bool DirTree::save( unsigned char* buffer, size_t len )
 {
-  size_t size = 128*entryCount();
-  if (len < size)
+  if (len < 128*entryCount())
     return false;
-  
-  memset( buffer, 0, size );
-  
-  for( unsigned i = 0; i < entryCount(); i++ )
+  return save( 0, buffer, len );
+}
+
+bool DirTree::save( size_t first, unsigned char* buffer, size_t len )
+{
+  memset( buffer, 0, len );
+  for( size_t p = 0; p + 128 <= len; p += 128 )
   {
-    const DirEntry* e = entry( i );
-    if( !e ) return false;
-	//if (!e->modified()) continue;
+    // past the last entry, the blocks hold free entries
+    const DirEntry* e = entry( first + p/128 );
+    if( !e )
+    {
+      writeU32( buffer + p + 0x44, DirEntry::End );
+      writeU32( buffer + p + 0x48, DirEntry::End );
+      writeU32( buffer + p + 0x4c, DirEntry::End );
+      continue;
+    }
     
     // max length for name is 32 chars
     std::string name = e->name();
@@ -298,20 +431,71 @@ bool DirTree::save( unsigned char* buffer, size_t len )
       
     // write name as Unicode 16-bit
     for( unsigned j = 0; j < name.length(); j++ )
-      buffer[ i*128 + j*2 ] = name[j];
-
-    writeU16( buffer + i*128 + 0x40, (ULONG16)(name.length()*2 + 2) );    
-    writeU32( buffer + i*128 + 0x74, e->start() );
-    writeU32( buffer + i*128 + 0x78, e->size() );
-    writeU32( buffer + i*128 + 0x44, e->prev() );
-    writeU32( buffer + i*128 + 0x48, e->next() );
-    writeU32( buffer + i*128 + 0x4c, e->child() );
-    buffer[ i*128 + 0x42 ] = e->type();
-    buffer[ i*128 + 0x43 ] = 1; // always black
+      buffer[ p + j*2 ] = name[j];
+
+    writeU16( buffer + p + 0x40, (ULONG16)(name.length()*2 + 2) );    
+    writeU32( buffer + p + 0x74, e->start() );
+    writeU32( buffer + p + 0x78, e->size() );
+    writeU32( buffer + p + 0x44, e->prev() );
+    writeU32( buffer + p + 0x48, e->next() );
+    writeU32( buffer + p + 0x4c, e->child() );
+    buffer[ p + 0x42 ] = e->type();
+    buffer[ p + 0x43 ] = e->color();
   }  
   return true;
 }
 
+bool DirTree::modified( size_t first, size_t count ) const
+{
+  for( size_t i = first; ( i < first + count ) && ( i < entryCount() ); i++ )
+    if( _entries[i].modified() )
+      return true;
+  return false;
+}
+
+void DirTree::clean()
+{
+  for( size_t i = 0; i < entryCount(); i++ )
+    _entries[i].set_modif( false );
+}
+
+void DirTree::balance()
+{
+  std::vector<bool> visited( entryCount(), false );
+  for( size_t i = 0; i < entryCount(); i++ )
+  {
+    if( !_entries[i].dir() )
+      continue;
+    std::vector<size_t> chi;
+    children( i, chi, visited );
+    if( chi.empty() )
+      continue;
+    std::sort( chi.begin(), chi.end(), [this]( size_t a, size_t b )
+      { return DirEntry::compare_names( _entries[a].name(), _entries[b].name() ) < 0; } );
+
+    // the tree is complete but for its last level, which is red
+    size_t levels = 1;
+    while( ( (size_t)1 << levels ) - 1 < chi.size() )
+      levels++;
+    size_t red_depth = ( ( (size_t)1 << levels ) - 1 == chi.size() ) ? -1 : levels-1;
+    _entries[i].set_child( link_siblings( chi, 0, chi.size(), 0, red_depth ) );
+  }
+  _unsorted.assign( entryCount(), false );
+}
+
+// link sorted[first, last) as a tree, return its root
+ULONG32 DirTree::link_siblings( const std::vector<size_t>& sorted, size_t first, size_t last, size_t depth, size_t red_depth )
+{
+  if( first >= last )
+    return DirEntry::End;
+  size_t middle = first + ( last-first ) / 2;
+  DirEntry& e = _entries[ sorted[middle] ];
+  e.set_prev( link_siblings( sorted, first, middle, depth+1, red_depth ) );
+  e.set_next( link_siblings( sorted, middle+1, last, depth+1, red_depth ) );
+  e.set_color( ( depth == red_depth ) ? DirEntry::Red : DirEntry::Black );
+  return (ULONG32)sorted[middle];
+}
+
 void DirTree::debug()
 {
   for( unsigned i = 0; i < entryCount(); i++ )
@@ -343,38 +527,185 @@ void DirTree::debug()
   }
 }
 
-// helper function: recursively find siblings of index
-void DirTree::find_siblings( std::vector<size_t>& result, ULONG32 index ) const
+// helper function: find siblings of index, in the order a recursive
+// walk (myself, previous siblings, next siblings) would visit them
+void DirTree::find_siblings( std::vector<size_t>& result, ULONG32 index, std::vector<bool>& visited ) const
 {
-  const DirEntry* e = entry( index );
-  if( !e ) return;
-  if( !e->valid() ) return;
+  // prevent infinite loop
+  size_t first = result.size();
+  for( size_t i = 0; i < first; i++ )
+    if( result[i] < visited.size() )
+      visited[ result[i] ] = true;
+
+  std::vector<ULONG32> pending;
+  pending.push_back( index );
+  while( !pending.empty() )
+  {
+    index = pending.back();
+    pending.pop_back();
 
-  // prevent infinite loop  
-  for( unsigned i = 0; i < result.size(); i++ )
-    if( result[i] == index ) return;
+    const DirEntry* e = entry( index );
+    if( !e ) continue;
+    if( !e->valid() ) continue;
+    if( visited[ index ] ) continue;
+
+    // add myself
+    visited[ index ] = true;
+    result.push_back( index );
+
+    // visit previous sibling before next sibling
+    ULONG32 next = e->next();
+    if( ( next > 0 ) && ( next < entryCount() ) && !visited[ next ] )
+      pending.push_back( next );
+    ULONG32 prev = e->prev();
+    if( ( prev > 0 ) && ( prev < entryCount() ) && !visited[ prev ] )
+      pending.push_back( prev );
+  }
 
-  // add myself    
-  result.push_back( index );
-  
-  // visit previous sibling, don't go infinitely
-  ULONG32 prev = e->prev();
-  if( ( prev > 0 ) && ( prev < entryCount() ) )
+  // leave the bitmap clear for the next call
+  for( size_t i = 0; i < result.size(); i++ )
+    if( result[i] < visited.size() )
+      visited[ result[i] ] = false;
+}
+
+// flag the storages whose children can't be found by descending their
+// tree: names out of order, invalid entries or loops
+void DirTree::check_sorted()
+{
+  _unsorted.assign( entryCount(), false );
+  std::vector<bool> visited( entryCount(), false );
+  for( size_t i = 0; i < entryCount(); i++ )
   {
-    for( unsigned i = 0; i < result.size(); i++ )
-      if( result[i] == prev ) prev = 0;
-    if( prev ) find_siblings( result, prev );
+    if( !_entries[i].valid() || ( _entries[i].child() == DirEntry::End ) )
+      continue;
+
+    // in-order walk, the names must grow
+    std::vector<size_t> seen;
+    std::vector<size_t> stack;
+    const DirEntry* last = NULL;
+    ULONG32 node = _entries[i].child();
+    bool sorted = true;
+    while( sorted && ( ( node != DirEntry::End ) || !stack.empty() ) )
+    {
+      if( node != DirEntry::End )
+      {
+        if( ( node >= entryCount() ) || visited[ node ] || !_entries[node].valid() )
+        {
+          sorted = false;
+          break;
+        }
+        visited[ node ] = true;
+        seen.push_back( node );
+        stack.push_back( node );
+        node = _entries[node].prev();
+        continue;
+      }
+      const DirEntry* e = &_entries[ stack.back() ];
+      stack.pop_back();
+      if( last && ( DirEntry::compare_names( last->name(), e->name() ) >= 0 ) )
+        sorted = false;
+      last = e;
+      node = e->next();
+    }
+    _unsorted[i] = !sorted;
+    for( size_t j = 0; j < seen.size(); j++ )
+      visited[ seen[j] ] = false;
   }
-    
-  // visit next sibling, don't go infinitely
-  ULONG32 next = e->next();
-  if( ( next > 0 ) && ( next < entryCount() ) )
+}
+
+// replace the link to from by a link to to, in above or in the child of
+// parent when from is the root of the tree
+void DirTree::relink( size_t above, size_t parent, size_t from, size_t to )
+{
+  if( above == None )
+    _entries[parent].set_child( (ULONG32)to );
+  else if( _entries[above].prev() == from )
+    _entries[above].set_prev( (ULONG32)to );
+  else
+    _entries[above].set_next( (ULONG32)to );
+}
+
+// link the new entry index among the children of parent. A red-black
+// insertion keeps the tree sorted and balanced; entries have no link to
+// their parent in the tree, so the path from the root is kept instead.
+void DirTree::insert_child( size_t parent, size_t index )
+{
+  DirEntry& e = _entries[index];
+  ULONG32 node = _entries[parent].child();
+  if( ( parent < _unsorted.size() ) && _unsorted[parent] )
   {
-    for( unsigned i = 0; i < result.size(); i++ )
-      if( result[i] == next ) next = 0;
-    if( next ) find_siblings( result, next );
+    // the tree is no search tree anyway, the entry becomes its root
+    e.set_next( node );
+    _entries[parent].set_child( (ULONG32)index );
+    return;
+  }
 
+  std::vector<size_t> path;
+  while( ( node < entryCount() ) && ( path.size() < entryCount() ) )
+  {
+    path.push_back( node );
+    node = ( DirEntry::compare_names( e.name(), _entries[node].name() ) < 0 ) ? _entries[node].prev() : _entries[node].next();
   }
+  if( path.empty() )
+  {
+    e.set_color( DirEntry::Black );
+    _entries[parent].set_child( (ULONG32)index );
+    return;
+  }
+  DirEntry& leaf = _entries[ path.back() ];
+  if( DirEntry::compare_names( e.name(), leaf.name() ) < 0 )
+    leaf.set_prev( (ULONG32)index );
+  else
+    leaf.set_next( (ULONG32)index );
+  e.set_color( DirEntry::Red );
+  path.push_back( index );
+
+  // x and its parent p are both red: recolor, or rotate and stop
+  size_t n = path.size()-1;
+  while( ( n >= 2 ) && ( _entries[ path[n-1] ].color() == DirEntry::Red ) )
+  {
+    size_t x = path[n], p = path[n-1], g = path[n-2];
+    size_t above = ( n >= 3 ) ? path[n-3] : None;
+    bool left = ( _entries[g].prev() == p );
+    ULONG32 u = left ? _entries[g].next() : _entries[g].prev();
+    if( ( u < entryCount() ) && ( _entries[u].color() == DirEntry::Red ) )
+    {
+      _entries[p].set_color( DirEntry::Black );
+      _entries[u].set_color( DirEntry::Black );
+      _entries[g].set_color( DirEntry::Red );
+      n -= 2;
+      continue;
+    }
+    if( left )
+    {
+      if( _entries[p].next() == x )
+      {
+        _entries[p].set_next( _entries[x].prev() );
+        _entries[x].set_prev( (ULONG32)p );
+        _entries[g].set_prev( (ULONG32)x );
+        p = x;
+      }
+      _entries[g].set_prev( _entries[p].next() );
+      _entries[p].set_next( (ULONG32)g );
+    }
+    else
+    {
+      if( _entries[p].prev() == x )
+      {
+        _entries[p].set_prev( _entries[x].next() );
+        _entries[x].set_next( (ULONG32)p );
+        _entries[g].set_next( (ULONG32)x );
+        p = x;
+      }
+      _entries[g].set_next( _entries[p].prev() );
+      _entries[p].set_prev( (ULONG32)g );
+    }
+    relink( above, parent, g, p );
+    _entries[p].set_color( DirEntry::Black );
+    _entries[g].set_color( DirEntry::Red );
+    break;
+  }
+  _entries[ _entries[parent].child() ].set_color( DirEntry::Black );
 }
 
 size_t DirTree::search_prev_link( size_t _entry )
@@ -432,6 +763,15 @@ size_t DirTree::find_rightmost_sibling(size_t sib)
 	return -1;
 }
 
+bool DirTree::delete_entry(const std::string& path)
+{
+	bool result = delete_entry( path, 0 );
+	check_sorted();
+	invalidate_paths();
+	build_paths();
+	return result;
+}
+
 bool DirTree::delete_entry(const std::string& path, int level)
 {
 	// Deletion is not posible over Root Entry
@@ -559,6 +899,7 @@ bool DirTree::delete_entry(const std::string& path, int level)
 			}
 		}
 	}
+	_parents[e->index()] = None;
 	e->set("", 0, 0, 0, 0, DirEntry::End, DirEntry::End, DirEntry::End, 0, true);
 
 	return true;
@@ -0,0 +1,141 @@
+/* POLE - Portable C++ library to access OLE Storage
+   Copyright (C) 2002-2004 Ariya Hidayat <ariya@kde.org>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, US
+*/
+
+
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "../../../includes/pole/detail/filemap.hpp"
+
+namespace POLE
+{
+
+// =========== FileMap ==========
+
+#if defined(WIN32)
+
+FileMap::FileMap(): _file(NULL), _mapping(NULL), _data(NULL), _size(0)
+{
+}
+
+bool FileMap::open( const char* filename )
+{
+	close();
+	HANDLE file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	return map( file );
+}
+
+bool FileMap::open( const wchar_t* filename )
+{
+	close();
+	HANDLE file = CreateFileW( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	return map( file );
+}
+
+bool FileMap::map( void* file )
+{
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	_file = file;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx( (HANDLE)_file, &size ) || size.QuadPart == 0)
+	{
+		close();
+		return false;
+	}
+
+	_mapping = CreateFileMappingA( (HANDLE)_file, NULL, PAGE_READONLY, 0, 0, NULL );
+	if (!_mapping)
+	{
+		close();
+		return false;
+	}
+
+	_data = (const unsigned char*)MapViewOfFile( (HANDLE)_mapping, FILE_MAP_READ, 0, 0, 0 );
+	if (!_data)
+	{
+		close();
+		return false;
+	}
+	_size = (size_t)size.QuadPart;
+	return true;
+}
+
+void FileMap::close()
+{
+	if (_data)
+		UnmapViewOfFile( _data );
+	if (_mapping)
+		CloseHandle( (HANDLE)_mapping );
+	if (_file)
+		CloseHandle( (HANDLE)_file );
+	_data = NULL;
+	_mapping = NULL;
+	_file = NULL;
+	_size = 0;
+}
+
+#else
+
+FileMap::FileMap(): _data(NULL), _size(0)
+{
+}
+
+bool FileMap::open( const char* filename )
+{
+	close();
+	int fd = ::open( filename, O_RDONLY );
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat( fd, &st ) != 0 || st.st_size == 0)
+	{
+		::close( fd );
+		return false;
+	}
+
+	// the mapping stays valid after the descriptor is closed
+	void* data = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	::close( fd );
+	if (data == MAP_FAILED)
+		return false;
+
+	_data = (const unsigned char*)data;
+	_size = (size_t)st.st_size;
+	return true;
+}
+
+void FileMap::close()
+{
+	if (_data)
+		munmap( (void*)_data, _size );
+	_data = NULL;
+	_size = 0;
+}
+
+#endif
+
+}
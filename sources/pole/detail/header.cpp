@@ -105,7 +105,7 @@ bool Header::save( unsigned char* buffer, size_t len )
   writeU32( buffer + 12, 0 );             // unknown
   writeU32( buffer + 16, 0 );             // unknown
   writeU16( buffer + 24, 0x003e );        // revision ?
-  writeU16( buffer + 26, 3 );             // version ?
+  writeU16( buffer + 26, ( _b_shift == 12 ) ? 4 : 3 ); // version, 4 for 4096 bytes blocks
   writeU16( buffer + 28, 0xfffe );        // unknown
   writeU16( buffer + 0x1e, _b_shift );
   writeU16( buffer + 0x20, _s_shift );
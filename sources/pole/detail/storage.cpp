@@ -18,6 +18,7 @@
 */
 
 
+#include <algorithm>
 #include <iostream>
 #include <string.h>
 #include "../../../includes/pole/detail/util.hpp"
@@ -26,52 +27,79 @@
 #include "../../../includes/pole/detail/alloctable.hpp"
 #include "../../../includes/pole/detail/storage.hpp"
 #include "../../../includes/pole/detail/stream.hpp"
+#include "../../../includes/pole/detail/workers.hpp"
 
 namespace POLE
 {
 
 // =========== StorageIO ==========
 
-StorageIO::StorageIO( const char* filename )
+// open filename with the device matching mode
+template<typename T>
+static BlockDevice* open_device( const T* filename, int mode )
+{
+	if (mode & StorageIO::MemoryMapped)
+	{
+		MappedDevice* map = new MappedDevice();
+		if (map->open( filename ))
+			return map;
+		delete map;
+		return NULL;
+	}
+	FileDevice* file = new FileDevice();
+	if (file->open( filename ))
+		return file;
+	delete file;
+	return NULL;
+}
+
+StorageIO::StorageIO( const char* filename, int mode )
 {
 	m_dtmodified = false;
 	init();
-
-	// open the file, check for error
-	_result = OpenFailed;
-	std::fstream* file = new std::fstream( filename, std::ios::binary | std::ios::in | std::ios::out);
-	if( !file || file->fail() ) return;
-	_file = file;
-	_stream = file;
-	load();
+	_preload_mini = (mode & PreloadMiniStream) != 0;
+	_transacted = (mode & Transacted) != 0;
+	attach( open_device( filename, mode ), true );
 }
 
 #if defined(WIN32)
-StorageIO::StorageIO(const wchar_t* filename)
+StorageIO::StorageIO(const wchar_t* filename, int mode)
 {
 	m_dtmodified = false;
 	init();
-
-	// open the file, check for error
-	_result = OpenFailed;
-	std::fstream* file = new std::fstream(filename, std::ios::binary | std::ios::in | std::ios::out);
-	if (!file || file->fail()) return;
-	_file = file;
-	_stream = file;
-	load();
+	_preload_mini = (mode & PreloadMiniStream) != 0;
+	_transacted = (mode & Transacted) != 0;
+	attach( open_device( filename, mode ), true );
 }
 #endif
 
 StorageIO::StorageIO( std::iostream* stream )
 {
+	m_dtmodified = false;
 	init();
-	_result = OpenFailed;
-	_stream = stream;
-	load();
+	attach( stream ? new StreamDevice( stream ) : NULL, true );
+}
+
+StorageIO::StorageIO( BlockDevice* device, int mode )
+{
+	m_dtmodified = false;
+	init();
+	_preload_mini = (mode & PreloadMiniStream) != 0;
+	_transacted = (mode & Transacted) != 0;
+	attach( device, false );
+}
+
+StorageIO::StorageIO( const void* data, size_t len )
+{
+	m_dtmodified = false;
+	init();
+	attach( new MemoryDevice( data, len ), true );
 }
 
 StorageIO::~StorageIO()
 {
+	// pending reads finish before anything goes away
+	delete _workers;
 	flush();
 	close();
 	if (_sbat) delete _sbat;
@@ -83,8 +111,14 @@ StorageIO::~StorageIO()
 void StorageIO::init()
 {
 	_result = Ok;
-	_file = NULL;
-	_stream = NULL;
+	_device = NULL;
+	_owned = false;
+	_workers = NULL;
+	_preload_mini = false;
+	_mini_loaded = false;
+	_bat_modified = false;
+	_transacted = false;
+	_chain_changes = 0;
 
 	_header = new Header();
 	_dirtree = new DirTree();
@@ -92,20 +126,33 @@ void StorageIO::init()
 	_sbat = new AllocTable(1 << _header->s_shift());
 
 	_size = 0;
+	_cache.set_capacity( DefaultCacheSectors );
+}
+
+// use device for the storage and load it, check for error
+void StorageIO::attach( BlockDevice* device, bool owned )
+{
+	_result = OpenFailed;
+	if (!device)
+		return;
+	_device = device;
+	_owned = owned;
+	if (!good())
+		return;
+	load();
 }
 
 bool StorageIO::load()
 {
-	if (!_stream) return false;
+	if (!good()) return false;
 
 	// find size of input file
-	_stream->seekg( 0, std::ios::end );
-	_size = (ULONG32)_stream->tellg();
+	_size = (ULONG32)_device->size();
 
 	// load header
 	unsigned char* buffer = new unsigned char[512];
-	_stream->seekg( 0 ); 
-	_stream->read( (char*)buffer, 512 );
+	memset( buffer, 0, 512 );
+	readAt( 0, buffer, 512 );
 	bool res = _header->load( buffer, 512 );
 	delete[] buffer;
 	if (!res)
@@ -124,32 +171,36 @@ bool StorageIO::load()
 	// important block size
 	_bbat->set_block_size(1 << _header->b_shift());
 	_sbat->set_block_size(1 << _header->s_shift());
+	_cache.set_sector_size(_bbat->block_size());
 
 	// find blocks allocated to store big bat
 	// the first 109 blocks are in header, the rest in meta bat
-	std::vector<ULONG32> blocks;
-	blocks.resize( _header->num_bat() );
+	BlockChain& blocks = _bat_blocks;
 	for( unsigned i = 0; i < 109; i++ )
 	{
 		if( i >= _header->num_bat() ) 
 			break;
 		else 
-			blocks[i] = _header->bb_blocks()[i];
+			blocks.push_back( _header->bb_blocks()[i] );
 	}
 	if( (_header->num_bat() > 109) && (_header->num_mbat() > 0) )
 	{
-		unsigned char* buffer2 = new unsigned char[ _bbat->block_size() ];
-		unsigned k = 109;
-		for( unsigned r = 0; r < _header->num_mbat(); r++ )
+		// meta bat blocks are chained by their last entry
+		const ULONG32 block_size = _bbat->block_size();
+		unsigned char* buffer2 = new unsigned char[ block_size ];
+		ULONG32 mblock = _header->mbat_start();
+		for( unsigned r = 0; r < _header->num_mbat() && mblock != AllocTable::Eof; r++ )
 		{
-			loadBigBlock( _header->mbat_start()+r, buffer2, _bbat->block_size() );
-			for( unsigned s=0; s < _bbat->block_size(); s+=4 )
+			if( loadBigBlock( mblock, buffer2, block_size ) != block_size )
+				break;
+			_mbat_blocks.push_back( mblock );
+			for( unsigned s=0; s < block_size-4; s+=4 )
 			{
-				if( k >= _header->num_bat() ) 
+				if( blocks.size() >= _header->num_bat() ) 
 					break;
-				else  
-					blocks[k++] = readU32( buffer2 + s );
+				blocks.push_back( readU32( buffer2 + s ) );
 			}  
+			mblock = readU32( buffer2 + block_size-4 );
 		}    
 		delete[] buffer2;
 	}
@@ -159,39 +210,49 @@ bool StorageIO::load()
 	if( buflen > 0 )
 	{
 		buffer = new unsigned char[ buflen ];  
-		loadBigBlocks( blocks, buffer, buflen );
-		_bbat->load( buffer, buflen );
+		bool read = ( loadBigBlocks( blocks, buffer, buflen ) == buflen );
+		if (read)
+			_bbat->load( buffer, buflen );
 		delete[] buffer;
+		if (!read)
+			return false;
 	}  
 
-	// load small bat
-	blocks.clear();
-	if (!_bbat->follow( _header->sbat_start(), blocks ))
+	// load small bat, if any
+	if (_header->sbat_start() != AllocTable::Eof && !_bbat->follow( _header->sbat_start(), _sbat_blocks ))
 		return false;
-	buflen = (ULONG32)(blocks.size()*_bbat->block_size());
+	buflen = (ULONG32)(_sbat_blocks.size()*_bbat->block_size());
 	if( buflen > 0 )
 	{
 		buffer = new unsigned char[ buflen ];  
-		loadBigBlocks( blocks, buffer, buflen );
-		_sbat->load( buffer, buflen );
+		bool read = ( loadBigBlocks( _sbat_blocks, buffer, buflen ) == buflen );
+		if (read)
+			_sbat->load( buffer, buflen );
 		delete[] buffer;
+		if (!read)
+			return false;
 	}  
 		
 	// load directory tree
-	blocks.clear();
-	if (!_bbat->follow( _header->dirent_start(), blocks ))
+	if (!_bbat->follow( _header->dirent_start(), _dir_blocks ))
 		return false;
-	buflen = (ULONG32)(blocks.size()*_bbat->block_size());
+	buflen = (ULONG32)(_dir_blocks.size()*_bbat->block_size());
 	buffer = new unsigned char[ buflen ];  
-	loadBigBlocks( blocks, buffer, buflen );
-	if (!_dirtree->load( buffer, buflen ))
+	if (loadBigBlocks( _dir_blocks, buffer, buflen ) != buflen || !_dirtree->load( buffer, buflen ))
+	{
+		delete[] buffer;
 		return false;
+	}
 	unsigned sb_start = readU32( buffer + 0x74 );
 	delete[] buffer;
 		
 	// fetch block chain as data for small-files
-	if (!_bbat->follow( sb_start, _sb_blocks ))// small files
+	if (sb_start != AllocTable::Eof && !_bbat->follow( sb_start, _sb_blocks ))// small files
 		return false;
+	if (_preload_mini && !mapped())
+		loadMiniStream();
+	if (_transacted)
+		protect();
 
 	// for troubleshooting, just enable this block
 	#if 0
@@ -208,19 +269,19 @@ bool StorageIO::load()
 
 bool StorageIO::create( const char* filename )
 {
-  std::fstream* file = new std::fstream(filename, std::ios::out|std::ios::binary);
-  if( !file || file->fail() )
+  FileDevice* file = new FileDevice();
+  if( !file->open( filename, true ) )
   {
     _result = OpenFailed;
-	if (file)
-		delete file;
+    delete file;
     return false;
   }
   
   // so far so good
   _result = Ok;
-  _file = file;
-  _stream = file;
+  _device = file;
+  _owned = true;
+  _size = 0;
   return true;
 }
 
@@ -232,68 +293,159 @@ void StorageIO::close()
 	delete *it;
 	_streams.clear();
 
-	if (_file)
+	if (_device)
 	{
-	_file->close();
-	delete _file;
-	_file = NULL;
+		_device->flush();
+		if (_owned)
+			delete _device;
+		_device = NULL;
 	}
 }
 
-ULONG32 StorageIO::loadBigBlocks( const std::vector<ULONG32>& blocks, unsigned char* data, ULONG32 maxlen )
+// read len bytes at the given position of the storage, small reads
+// through the sector cache
+ULONG32 StorageIO::readAt( ULONG32 pos, unsigned char* data, ULONG32 len )
+{
+	if (pos >= _size)
+		return 0;
+	if (len > _size - pos)
+		len = _size - pos;
+
+	const size_t sector_size = _cache.sector_size();
+	if (mapped() || len > CachedReadSectors * sector_size || ( _cache.capacity() == 0 && _cache.size() == 0 ))
+		return (ULONG32)_device->read_at( pos, data, len );
+
+	std::vector<unsigned char> buffer;
+	ULONG32 bytes = 0;
+	while (bytes < len)
+	{
+		size_t sector = ( pos + bytes ) / sector_size;
+		size_t offset = ( pos + bytes ) % sector_size;
+		ULONG32 p = ( len - bytes < sector_size - offset ) ? len - bytes : (ULONG32)( sector_size - offset );
+		if (!_cache.get( sector, offset, data + bytes, p ))
+		{
+			// read the whole sector for the next reads
+			size_t first = sector * sector_size;
+			buffer.resize( sector_size );
+			size_t read = _device->read_at( first, &buffer[0], ( _size - first < sector_size ) ? _size - first : sector_size );
+			if (read <= offset)
+				break;
+			_cache.put( sector, &buffer[0], read );
+			if (p > read - offset)
+				p = (ULONG32)( read - offset );
+			memcpy( data + bytes, &buffer[offset], p );
+		}
+		bytes += p;
+	}
+	return bytes;
+}
+
+ULONG32 StorageIO::loadBigBlocks( const BlockChain& blocks, unsigned char* data, ULONG32 maxlen )
+{
+  return loadBigBlocks( blocks, 0, data, maxlen );
+}
+
+ULONG32 StorageIO::loadBigBlocks( const BlockChain& blocks, size_t pos, unsigned char* data, ULONG32 maxlen )
 {
   // sentinel
-  if( !_stream ) return 0; 
   if( !data ) return 0;
-  if( !_stream->good() ) return 0;
+  if( !good() ) return 0;
   if( blocks.size() < 1 ) return 0;
   if( maxlen == 0 ) return 0;
 
-  // read block one by one, seems fast enough
+  const ULONG32 block_size = _bbat->block_size();
+  size_t index = pos / block_size;
+  if( index >= blocks.size() ) return 0;
+
+  // each extent is a run of consecutive blocks, read it at once
+  const std::vector<BlockChain::Extent>& extents = blocks.extents();
   ULONG32 bytes = 0;
-  for( ULONG32 i=0; (i < blocks.size() ) && ( bytes < maxlen ); i++ )
+  for( size_t e = blocks.find( index ); ( e < extents.size() ) && ( bytes < maxlen ); e++ )
   {
-    ULONG32 block = blocks[i];
-	ULONG32 pos =  _bbat->block_size() * ( block+1 );
-    ULONG32 p = (_bbat->block_size() < maxlen-bytes) ? _bbat->block_size() : maxlen-bytes;
-    if( pos + p > _size ) 
-		p = _size - pos;
-	_stream->seekg( pos );
-	_stream->read( (char*)data + bytes, p );
-    bytes += p;
+    ULONG32 skip = (ULONG32)( index - extents[e].offset );
+    ULONG32 offset = (ULONG32)( pos % block_size );
+    ULONG32 fpos = block_size * ( extents[e].start+skip+1 ) + offset;
+    size_t p = (size_t)( extents[e].length-skip ) * block_size - offset;
+    if( p > maxlen-bytes )
+      p = maxlen-bytes;
+    if( fpos >= _size )
+      break;
+    ULONG32 read = readAt( fpos, data + bytes, (ULONG32)p );
+    bytes += read;
+    // a short read ends the data, the next extent would land at the
+    // wrong place of the buffer
+    if( read < p )
+      break;
+    index = extents[e].offset + extents[e].length;
+    pos = 0;
   }
 
   return bytes;
 }
 
+void StorageIO::readahead( const BlockChain& blocks, size_t pos, size_t len )
+{
+  if( !good() || len == 0 ) return;
+
+  const ULONG32 block_size = _bbat->block_size();
+  size_t index = pos / block_size;
+  const std::vector<BlockChain::Extent>& extents = blocks.extents();
+  for( size_t e = blocks.find( index ); ( e < extents.size() ) && ( len > 0 ); e++ )
+  {
+    size_t skip = index - extents[e].offset;
+    size_t offset = pos % block_size;
+    size_t fpos = (size_t)block_size * ( extents[e].start+skip+1 ) + offset;
+    size_t p = (size_t)( extents[e].length-skip ) * block_size - offset;
+    if( p > len )
+      p = len;
+    _device->advise( fpos, p );
+    len -= p;
+    index = extents[e].offset + extents[e].length;
+    pos = 0;
+  }
+}
+
 ULONG32 StorageIO::loadBigBlock( ULONG32 block, unsigned char* data, ULONG32 maxlen )
 {
   // sentinel
   if( !data ) return 0;
-  if( !_stream || !_stream->good() ) return 0;
+  if( !good() ) return 0;
   
   // wraps call for loadBigBlocks
-  std::vector<ULONG32> blocks;
-  blocks.resize( 1 );
-  blocks[ 0 ] = block;
+  BlockChain blocks;
+  blocks.push_back( block );
   
   return loadBigBlocks( blocks, data, maxlen );
 }
 
 // return number of bytes which has been read
-ULONG32 StorageIO::loadSmallBlocks( const std::vector<ULONG32>& blocks, unsigned char* data, ULONG32 maxlen )
+ULONG32 StorageIO::loadSmallBlocks( const BlockChain& blocks, unsigned char* data, ULONG32 maxlen )
 {
   // sentinel
   if( !data ) return 0;
-  if( !_stream || !_stream->good() ) return 0;
+  if( !good() ) return 0;
   if( blocks.size() < 1 ) return 0;
   if( maxlen == 0 ) return 0;
 
+  // small blocks in memory are simply copied
+  ULONG32 bytes = 0;
+  if( direct_small_blocks() )
+  {
+    for( ULONG32 i=0; ( i<blocks.size() ) && ( bytes<maxlen ); i++ )
+    {
+      const unsigned char* src = smallBlockData( blocks[i] );
+      if( !src ) break;
+      ULONG32 p = ( maxlen-bytes < _sbat->block_size() ) ? maxlen-bytes : _sbat->block_size();
+      memcpy( data + bytes, src, p );
+      bytes += p;
+    }
+    return bytes;
+  }
+
   // our own local buffer
   unsigned char* buf = new unsigned char[ _bbat->block_size() ];
 
   // read small block one by one
-  ULONG32 bytes = 0;
   for( ULONG32 i=0; ( i<blocks.size() ) && ( bytes<maxlen ); i++ )
   {
     ULONG32 block = blocks[i];
@@ -325,12 +477,11 @@ ULONG32 StorageIO::loadSmallBlock( ULONG32 block, unsigned char* data, ULONG32 m
 {
   // sentinel
   if( !data ) return 0;
-  if( !_stream || !_stream->good() ) return 0;
+  if( !good() ) return 0;
 
   // wraps call for loadSmallBlocks
-  std::vector<ULONG32> blocks;
-  blocks.resize( 1 );
-  blocks.assign( 1, block );
+  BlockChain blocks;
+  blocks.push_back( block );
 
   return loadSmallBlocks( blocks, data, maxlen );
 }
@@ -349,34 +500,723 @@ void StorageIO::listEntries(std::vector<const DirEntry*>& result) const
   _dirtree->listDirectory(result);
 }
 
+void StorageIO::listStreams(std::vector< std::pair<std::string, const DirEntry*> >& result) const
+{
+  const std::unordered_map<std::string, size_t>& paths = _dirtree->paths();
+  std::unordered_map<std::string, size_t>::const_iterator it;
+  for( it = paths.begin(); it != paths.end(); ++it )
+  {
+    const DirEntry* e = _dirtree->entry( it->second );
+    if( e && e->file() )
+      result.push_back( std::make_pair( it->first, e ) );
+  }
+}
+
+
+const unsigned char* StorageIO::bigBlockData( ULONG32 block, ULONG32 count ) const
+{
+	if (!mapped()) return NULL;
+
+	ULONG32 pos = _bbat->block_size() * ( block+1 );
+	if (pos + (size_t)count * _bbat->block_size() > _size)
+		return NULL;
+	return _device->data() + pos;
+}
+
+const unsigned char* StorageIO::smallBlockData( ULONG32 block )
+{
+	if (!direct_small_blocks()) return NULL;
+
+	// find the big block of the small-block container holding it
+	ULONG32 pos = block * _sbat->block_size();
+	ULONG32 bbindex = pos / _bbat->block_size();
+	if (bbindex >= _sb_blocks.size())
+		return NULL;
+
+	if (!mapped())
+	{
+		if (pos + _sbat->block_size() > _mini_data.size())
+			return NULL;
+		return &_mini_data[pos];
+	}
+
+	const unsigned char* data = bigBlockData( _sb_blocks[ bbindex ] );
+	return data ? data + ( pos % _bbat->block_size() ) : NULL;
+}
+
+// read the whole small-block container at once
+void StorageIO::loadMiniStream()
+{
+	_mini_loaded = true;
+	_mini_data.resize( _sb_blocks.size() * _bbat->block_size() );
+	if (_mini_data.empty())
+		return;
+	_mini_data.resize( loadBigBlocks( _sb_blocks, &_mini_data[0], (ULONG32)_mini_data.size() ) );
+}
 
 // Write a bigblock
 ULONG32 StorageIO::saveBlock(ULONG32 fisical_offset, const unsigned char* data, ULONG32 len)
 {
-	_file->seekp(fisical_offset);
-	_file->write((const char*)data, len);
+	// mapped storages are read-only
+	if (!_device || !_device->writable())
+		return 0;
+	len = (ULONG32)_device->write_at(fisical_offset, data, len);
+	if (fisical_offset + len > _size)
+		_size = fisical_offset + len;
+	_cache.write(fisical_offset, data, len);
+
+	// keep the preloaded small blocks up to date
+	if (_mini_loaded)
+	{
+		const ULONG32 block_size = _bbat->block_size();
+		const std::vector<BlockChain::Extent>& extents = _sb_blocks.extents();
+		for (size_t e = 0; e < extents.size(); e++)
+		{
+			size_t first = (size_t)( extents[e].start+1 ) * block_size;
+			size_t last = first + (size_t)extents[e].length * block_size;
+			size_t from = ( fisical_offset > first ) ? fisical_offset : first;
+			size_t to = ( fisical_offset + len < last ) ? fisical_offset + len : last;
+			size_t mini_pos = (size_t)extents[e].offset * block_size + ( from - first );
+			if ( from < to && mini_pos < _mini_data.size() )
+				memcpy( &_mini_data[mini_pos], data + ( from - fisical_offset ),
+					( to - from < _mini_data.size() - mini_pos ) ? to - from : _mini_data.size() - mini_pos );
+		}
+	}
 	return len;
 }
 
+ULONG32 StorageIO::saveBigBlocks( const BlockChain& blocks, size_t pos, const unsigned char* data, ULONG32 len )
+{
+  // sentinel
+  if( !data ) return 0;
+  if( !good() ) return 0;
+  if( blocks.size() < 1 ) return 0;
+  if( len == 0 ) return 0;
+
+  const ULONG32 block_size = _bbat->block_size();
+  size_t index = pos / block_size;
+  if( index >= blocks.size() ) return 0;
+
+  // each extent is a run of consecutive blocks, write it at once
+  const std::vector<BlockChain::Extent>& extents = blocks.extents();
+  ULONG32 bytes = 0;
+  for( size_t e = blocks.find( index ); ( e < extents.size() ) && ( bytes < len ); e++ )
+  {
+    ULONG32 skip = (ULONG32)( index - extents[e].offset );
+    ULONG32 offset = (ULONG32)( pos % block_size );
+    ULONG32 fpos = block_size * ( extents[e].start+skip+1 ) + offset;
+    size_t p = (size_t)( extents[e].length-skip ) * block_size - offset;
+    if( p > len-bytes )
+      p = len-bytes;
+    ULONG32 written = saveBlock( fpos, data + bytes, (ULONG32)p );
+    bytes += written;
+    if( written < p )
+      break;
+    index = extents[e].offset + extents[e].length;
+    pos = 0;
+  }
+
+  return bytes;
+}
+
+ULONG32 StorageIO::saveSmallBlock( ULONG32 block, ULONG32 offset, const unsigned char* data, ULONG32 len )
+{
+  // sentinel
+  if( !data ) return 0;
+  if( !good() ) return 0;
+  if( offset >= _sbat->block_size() ) return 0;
+
+  // find where the small-block exactly is
+  ULONG32 pos = block * _sbat->block_size() + offset;
+  ULONG32 bbindex = pos / _bbat->block_size();
+  if( bbindex >= _sb_blocks.size() ) return 0;
+
+  if( len > _sbat->block_size() - offset )
+    len = _sbat->block_size() - offset;
+  // the container moves block by block in transacted mode
+  if( !copy_on_write( _dirtree->entry( (size_t)0 ), _sb_blocks, pos, len ) )
+    return 0;
+  ULONG32 fpos = _bbat->block_size() * ( _sb_blocks[ bbindex ]+1 ) + pos % _bbat->block_size();
+  return saveBlock( fpos, data, len );
+}
+
+// number of entries up to the last one in use
+static size_t used_blocks( const AllocTable& table )
+{
+  size_t n = table.count();
+  while( n > 0 && table[n-1] == AllocTable::Avail )
+    n--;
+  return n;
+}
+
+// append count free blocks to chain
+bool StorageIO::allocate( AllocTable* table, ULONG32 count, BlockChain& chain )
+{
+  ULONG32 last = chain.empty() ? AllocTable::Eof : chain[ chain.size()-1 ];
+  for( ULONG32 i = 0; i < count; i++ )
+  {
+    ULONG32 block = ( table == _bbat ) ? unusedBlock() : (ULONG32)table->unused();
+    table->set( block, AllocTable::Eof );
+    if( last != AllocTable::Eof )
+      table->set( last, block );
+    chain.push_back( block );
+    last = block;
+  }
+  _bat_modified = true;
+  return true;
+}
+
+// enlarge the small-block container to hold every small block in use
+bool StorageIO::growMiniStream()
+{
+  const ULONG32 block_size = _bbat->block_size();
+  size_t bytes = used_blocks( *_sbat ) * _sbat->block_size();
+  size_t needed = ( bytes + block_size-1 ) / block_size;
+  size_t old = _sb_blocks.size();
+  if( needed > old )
+  {
+    allocate( _bbat, (ULONG32)( needed-old ), _sb_blocks );
+    if( _mini_loaded )
+      _mini_data.resize( _sb_blocks.size() * block_size );
+
+    // the new blocks are read whole, give them a content
+    std::vector<unsigned char> zeros( ( needed-old ) * block_size );
+    if( saveBigBlocks( _sb_blocks, old * block_size, &zeros[0], (ULONG32)zeros.size() ) != zeros.size() )
+      return false;
+  }
+
+  DirEntry* root = _dirtree->entry( 0 );
+  if( !root )
+    return false;
+  if( !_sb_blocks.empty() && root->start() != _sb_blocks[0] )
+    root->set_start( _sb_blocks[0] );
+  if( root->size() < bytes )
+    root->set_size( (ULONG32)bytes );
+  m_dtmodified = true;
+  return true;
+}
+
+bool StorageIO::resize( const DirEntry* e, ULONG32 size, BlockChain& blocks )
+{
+  if( !_device || !_device->writable() || _result != Ok )
+    return false;
+  // the entry knows where it is, it must still be there
+  DirEntry* entry = e ? _dirtree->entry( e->index() ) : NULL;
+  if( !entry || entry != e || !entry->file() )
+    return false;
+  if( size <= entry->size() )
+    return ( size == entry->size() );
+
+  // an empty stream has no blocks, whatever its start
+  if( entry->size() == 0 )
+    blocks.clear();
+
+  const ULONG32 threshold = _header->threshold();
+  if( size < threshold )
+  {
+    ULONG32 block_size = _sbat->block_size();
+    size_t needed = ( size + block_size-1 ) / block_size;
+    if( needed > blocks.size() )
+      allocate( _sbat, (ULONG32)( needed - blocks.size() ), blocks );
+    if( !growMiniStream() )
+      return false;
+  }
+  else
+  {
+    ULONG32 block_size = _bbat->block_size();
+    size_t needed = ( size + block_size-1 ) / block_size;
+    if( entry->size() > 0 && entry->size() < threshold )
+    {
+      // move the data from small to big blocks
+      std::vector<unsigned char> data( entry->size() );
+      if( loadSmallBlocks( blocks, &data[0], (ULONG32)data.size() ) != data.size() )
+        return false;
+      for( size_t i = 0; i < blocks.size(); i++ )
+        _sbat->set( blocks[i], AllocTable::Avail );
+      blocks.clear();
+      allocate( _bbat, (ULONG32)needed, blocks );
+      if( saveBigBlocks( blocks, 0, &data[0], (ULONG32)data.size() ) != data.size() )
+        return false;
+    }
+    else if( needed > blocks.size() )
+      allocate( _bbat, (ULONG32)( needed - blocks.size() ), blocks );
+  }
+
+  if( !blocks.empty() && entry->start() != blocks[0] )
+    entry->set_start( blocks[0] );
+  entry->set_size( size );
+  m_dtmodified = true;
+  _chain_changes++;
+  return true;
+}
+
+// write the sectors of the small bat, the big bat and the meta bat
+// changed since the last save, allocating the blocks they need. Returns
+// true if they moved and the header has to be saved
+bool StorageIO::saveAllocTables()
+{
+  const ULONG32 block_size = _bbat->block_size();
+  const size_t per_block = block_size / 4;
+  const size_t old_sbat = _sbat_blocks.size();
+  const size_t old_bat = _bat_blocks.size();
+  const size_t old_mbat = _mbat_blocks.size();
+
+  // small bat
+  size_t sbat_needed = ( used_blocks( *_sbat ) + per_block-1 ) / per_block;
+  if( sbat_needed > _sbat_blocks.size() )
+    allocate( _bbat, (ULONG32)( sbat_needed - _sbat_blocks.size() ), _sbat_blocks );
+
+  // blocks of the big bat are described by the big bat itself, and
+  // beyond 109 of them by the meta bat: allocate until all fit
+  for( ;; )
+  {
+    size_t bat_needed = ( used_blocks( *_bbat ) + per_block-1 ) / per_block;
+    size_t mbat_needed = ( bat_needed > 109 ) ? ( bat_needed-109 + per_block-2 ) / ( per_block-1 ) : 0;
+    if( bat_needed > _bat_blocks.size() )
+    {
+      ULONG32 block = unusedBlock();
+      _bbat->set( block, AllocTable::Bat );
+      _bat_blocks.push_back( block );
+    }
+    else if( mbat_needed > _mbat_blocks.size() )
+    {
+      ULONG32 block = unusedBlock();
+      _bbat->set( block, AllocTable::MetaBat );
+      _mbat_blocks.push_back( block );
+    }
+    else
+      break;
+  }
+
+  // the file covers every block in use
+  size_t end = ( used_blocks( *_bbat ) + 1 ) * block_size;
+  if( _size < end )
+  {
+    unsigned char zero = 0;
+    saveBlock( (ULONG32)( end-1 ), &zero, 1 );
+  }
+
+  std::vector<unsigned char> buffer;
+  if( !_sbat_blocks.empty() )
+  {
+    buffer.assign( std::max( _sbat_blocks.size() * block_size, _sbat->count() * 4 ), 0xff );
+    _sbat->save( &buffer[0], buffer.size() );
+    for( size_t i = 0; i < _sbat_blocks.size(); i++ )
+      if( i >= old_sbat || _sbat->modified( i * per_block, per_block ) )
+        saveBigBlocks( _sbat_blocks, i * block_size, &buffer[ i * block_size ], block_size );
+    _sbat->clean();
+  }
+
+  buffer.assign( std::max( _bat_blocks.size() * block_size, _bbat->count() * 4 ), 0xff );
+  _bbat->save( &buffer[0], buffer.size() );
+  for( size_t i = 0; i < _bat_blocks.size(); i++ )
+    if( i >= old_bat || _bbat->modified( i * per_block, per_block ) )
+      saveBigBlocks( _bat_blocks, i * block_size, &buffer[ i * block_size ], block_size );
+  _bbat->clean();
+
+  // meta bat blocks list the big bat blocks past the first 109 and
+  // end with the next meta bat block, only new entries change them
+  buffer.assign( block_size, 0xff );
+  for( size_t m = 0; m < _mbat_blocks.size(); m++ )
+  {
+    size_t first = 109 + m * ( per_block-1 );
+    if( m+1 < old_mbat && first + per_block-1 <= old_bat )
+      continue;
+    memset( &buffer[0], 0xff, block_size );
+    for( size_t s = 0; s < per_block-1; s++ )
+    {
+      size_t k = first + s;
+      if( k >= _bat_blocks.size() )
+        break;
+      writeU32( &buffer[s*4], _bat_blocks[k] );
+    }
+    writeU32( &buffer[block_size-4], ( m+1 < _mbat_blocks.size() ) ? _mbat_blocks[m+1] : AllocTable::Eof );
+    saveBlock( block_size * ( _mbat_blocks[m]+1 ), &buffer[0], block_size );
+  }
+
+  if( old_bat == _bat_blocks.size() && old_sbat == _sbat_blocks.size() && old_mbat == _mbat_blocks.size() )
+    return false;
+
+  _header->set_num_bat( (unsigned)_bat_blocks.size() );
+  for( unsigned i = 0; i < 109; i++ )
+    _header->set_bb_block( i, ( i < _bat_blocks.size() ) ? _bat_blocks[i] : AllocTable::Avail );
+  _header->set_mbat_start( _mbat_blocks.empty() ? AllocTable::Eof : _mbat_blocks[0] );
+  _header->set_num_mbat( (unsigned)_mbat_blocks.size() );
+  _header->set_sbat_start( _sbat_blocks.empty() ? AllocTable::Eof : _sbat_blocks[0] );
+  _header->set_num_sbat( (unsigned)_sbat_blocks.size() );
+  if( !_dir_blocks.empty() )
+    _header->set_dirent_start( _dir_blocks[0] );
+  return true;
+}
+
+bool StorageIO::saveHeader()
+{
+  unsigned char header[512];
+  if( !_header->save( header, 512 ) )
+    return false;
+  return saveBlock( 0, header, 512 ) == 512;
+}
+
 void StorageIO::flush()
+{
+	if (!_device || _result != Ok || _transacted)
+		return;
+
+	bool changed = m_dtmodified || _bat_modified;
+
+	// tables ending the file are written again lower when blocks were
+	// freed before them, so that the file can be cut
+	size_t last = used_blocks( *_bbat );
+	if (changed && last > 0 && ( (*_bbat)[last-1] == AllocTable::Bat || (*_bbat)[last-1] == AllocTable::MetaBat ) &&
+		_bbat->unused_before( last-1 ))
+	{
+		release( _bat_blocks );
+		release( _mbat_blocks );
+	}
+
+	if (saveChanges())
+		saveHeader();
+
+	// free blocks at the end of the file are cut off
+	size_t end = ( used_blocks( *_bbat ) + 1 ) * _bbat->block_size();
+	if (changed && _size > end && _device->truncate( end ))
+		_size = (ULONG32)end;
+	_device->flush();
+}
+
+bool StorageIO::delete_entry( const std::string& path )
+{
+	if (!_dirtree)
+		return false;
+
+	// the streams below the entry, their entries are blanked
+	std::vector<DirEntry> streams;
+	const DirEntry* e = _dirtree->entry( path );
+	std::vector<size_t> pending;
+	if (e && e->type() == 1)
+		_dirtree->children( e->index(), pending );
+	else if (e)
+		streams.push_back( *e );
+	while (!pending.empty())
+	{
+		const DirEntry* child = _dirtree->entry( pending.back() );
+		pending.pop_back();
+		if (child && child->type() == 1)
+			_dirtree->children( child->index(), pending );
+		else if (child && child->type() == 2)
+			streams.push_back( *child );
+	}
+
+	m_dtmodified = true;
+	if (!_dirtree->delete_entry( path ))
+		return false;
+	for (size_t i = 0; i < streams.size(); i++)
+		freeStreamBlocks( &streams[i] );
+	flush();
+	return true;
+}
+
+// give the blocks of a stream back to its allocation table. In
+// transacted mode the big blocks are not reused before the next commit.
+void StorageIO::freeStreamBlocks( const DirEntry* entry )
+{
+	if (entry->size() == 0 || entry->start() == AllocTable::Eof)
+		return;
+	if (entry->size() < _header->threshold())
+		_sbat->release( entry->start() );
+	else
+		_bbat->release( entry->start() );
+	_bat_modified = true;
+	_chain_changes++;
+}
+
+bool StorageIO::commit()
+{
+	if (!_transacted)
+	{
+		flush();
+		return _result == Ok;
+	}
+	if (!_device || !_device->writable() || _result != Ok)
+		return false;
+	if (!m_dtmodified && !_bat_modified)
+		return true;
+
+	// the directory and the tables go to new blocks as well, the ones of
+	// the last commit stay protected until the next one
+	release( _dir_blocks );
+	release( _sbat_blocks );
+	release( _bat_blocks );
+	release( _mbat_blocks );
+	m_dtmodified = true;
+	saveChanges();
+
+	// the header is written once everything it points to is on the disk,
+	// the commit is done once the header is
+	if (!_device->sync() || !saveHeader() || !_device->sync())
+		return false;
+	protect();
+	return true;
+}
+
+// write the directory and the tables changed since the last save,
+// returns true if the header has to be saved
+bool StorageIO::saveChanges()
 {
 	if (m_dtmodified && _bbat && _header)
 	{
-		std::vector<ULONG32> blocks;
-		if (!_bbat->follow( _header->dirent_start(), blocks ))
-			return;
-		ULONG32 bufflen = (ULONG32)(blocks.size() * _bbat->block_size());
-		unsigned char *buffer = new unsigned char[bufflen];
-		if (!_dirtree->save(buffer, bufflen))
-			return;
-		for (ULONG32 ndx = 0; ndx < blocks.size(); ++ndx)
+		// new entries may need more blocks
+		const ULONG32 block_size = _bbat->block_size();
+		size_t needed = ( _dirtree->entryCount()*128 + block_size-1 ) / block_size;
+		size_t saved = _dir_blocks.size();
+		if (needed > _dir_blocks.size())
+			allocate( _bbat, (ULONG32)( needed - _dir_blocks.size() ), _dir_blocks );
+
+		// only the blocks holding changed entries, and the new ones
+		const size_t per_block = block_size / 128;
+		std::vector<unsigned char> buffer( block_size );
+		for (size_t b = 0; b < _dir_blocks.size(); b++)
 		{
-			ULONG32 fisical_offset = (blocks[ndx] * big_block_size()) + big_block_size();
-			saveBlock(fisical_offset, buffer, big_block_size());
-			buffer += big_block_size();
+			if (b < saved && !_dirtree->modified( b * per_block, per_block ))
+				continue;
+			_dirtree->save( b * per_block, &buffer[0], block_size );
+			saveBigBlocks( _dir_blocks, b * block_size, &buffer[0], block_size );
 		}
+		_dirtree->clean();
 		m_dtmodified = false;
 	}
+
+	bool header = false;
+	if (_bat_modified)
+	{
+		header = saveAllocTables();
+		_bat_modified = false;
+	}
+	return header;
+}
+
+// free the blocks of chain
+void StorageIO::release( BlockChain& chain )
+{
+	for (size_t i = 0; i < chain.size(); i++)
+		_bbat->set( chain[i], AllocTable::Avail );
+	chain.clear();
+	_bat_modified = true;
+}
+
+// first free block, skipping the ones a committed header may still use
+ULONG32 StorageIO::unusedBlock()
+{
+	size_t block = _bbat->unused();
+	while (block < _protected.size() && _protected[block])
+		block = _bbat->unused( block+1 );
+	return (ULONG32)block;
+}
+
+// remember the blocks in use after a commit. Until the next commit is
+// synced the disk may hold either header, so the blocks of both stay
+// protected.
+void StorageIO::protect()
+{
+	std::vector<bool> used( _bbat->count() );
+	for (size_t i = 0; i < used.size(); i++)
+		used[i] = ( (*_bbat)[i] != AllocTable::Avail );
+	_protected.assign( std::max( used.size(), _committed.size() ), false );
+	for (size_t i = 0; i < _protected.size(); i++)
+		_protected[i] = ( i < used.size() && used[i] ) || ( i < _committed.size() && _committed[i] );
+	_committed.swap( used );
+}
+
+bool StorageIO::copy_on_write( const DirEntry* e, BlockChain& blocks, size_t pos, size_t len )
+{
+	if (_protected.empty() || len == 0 || blocks.empty())
+		return true;
+	DirEntry* entry = e ? _dirtree->entry( e->index() ) : NULL;
+	if (!entry || entry != e)
+		return false;
+
+	const ULONG32 block_size = _bbat->block_size();
+	size_t first = pos / block_size;
+	size_t last = ( pos + len - 1 ) / block_size;
+	if (last >= blocks.size())
+		last = blocks.size() - 1;
+
+	// a protected block is copied to a free one, which takes its place
+	// in the chain
+	bool moved = false;
+	std::vector<unsigned char> buffer( block_size );
+	ULONG32 prev = ( first > 0 ) ? blocks[first-1] : AllocTable::Eof;
+	for (size_t i = first; i <= last; i++)
+	{
+		ULONG32 block = blocks[i];
+		if (block >= _protected.size() || !_protected[block])
+		{
+			prev = block;
+			continue;
+		}
+		ULONG32 copy = unusedBlock();
+		memset( &buffer[0], 0, block_size );
+		loadBigBlock( block, &buffer[0], block_size );
+		if (saveBlock( block_size * ( copy+1 ), &buffer[0], block_size ) != block_size)
+			return false;
+		_bbat->set( copy, (*_bbat)[block] );
+		_bbat->set( block, AllocTable::Avail );
+		if (i == 0)
+			entry->set_start( copy );
+		else
+			_bbat->set( prev, copy );
+		prev = copy;
+		moved = true;
+	}
+
+	if (moved)
+	{
+		blocks.clear();
+		_bbat->follow( entry->start(), blocks );
+		m_dtmodified = true;
+		_bat_modified = true;
+		// the copy in _sb_blocks is the only one of the container
+		if (&blocks != &_sb_blocks)
+			_chain_changes++;
+	}
+	return true;
+}
+
+WorkerPool& StorageIO::workers()
+{
+	std::lock_guard<std::mutex> guard( _workers_lock );
+	if (!_workers)
+		_workers = new WorkerPool( AsyncReadThreads );
+	return *_workers;
 }
 
-}
\ No newline at end of file
+void StorageIO::pin_metadata()
+{
+	if (!_header || _result != Ok)
+		return;
+	BlockChain blocks;
+	_bbat->follow( _header->dirent_start(), blocks );
+	_bbat->follow( _header->sbat_start(), blocks );
+	const std::vector<BlockChain::Extent>& extents = blocks.extents();
+	for (size_t e = 0; e < extents.size(); e++)
+		for (ULONG32 b = 0; b < extents[e].length; b++)
+			_cache.pin( extents[e].start + b + 1 );
+	for (size_t e = 0; e < _sb_blocks.extents().size(); e++)
+		for (ULONG32 b = 0; b < _sb_blocks.extents()[e].length; b++)
+			_cache.pin( _sb_blocks.extents()[e].start + b + 1 );
+}
+
+// one stream read by extract
+struct ExtractJob
+{
+	Extraction* item;
+	const DirEntry* entry;
+	BlockChain blocks;
+	bool small;
+	ULONG32 first; // first big block holding the data
+};
+
+static bool first_in_file( const ExtractJob* a, const ExtractJob* b )
+{
+	return a->first < b->first;
+}
+
+bool StorageIO::extract( std::vector<Extraction>& streams, const ExtractCallback& callback, unsigned threads )
+{
+	if (!good() || _result != Ok)
+		return false;
+
+	// find the blocks of every stream
+	bool result = true;
+	bool small_streams = false;
+	const ULONG32 bb_size = _bbat->block_size();
+	const ULONG32 sb_size = _sbat->block_size();
+	std::vector<ExtractJob> jobs( streams.size() );
+	std::vector<ExtractJob*> order;
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		ExtractJob& job = jobs[i];
+		job.item = &streams[i];
+		job.entry = entry( streams[i].path );
+		if (!job.entry || !job.entry->file())
+		{
+			streams[i].size = 0;
+			result = false;
+			continue;
+		}
+		job.small = ( job.entry->size() < _header->threshold() );
+		job.first = DirEntry::End;
+		if (job.small)
+		{
+			follow_small_block_table( job.entry->start(), job.blocks );
+			ULONG32 bbindex = job.blocks.empty() ? 0 : job.blocks[0] * sb_size / bb_size;
+			if (bbindex < _sb_blocks.size())
+				job.first = _sb_blocks[ bbindex ];
+			small_streams = true;
+		}
+		else
+		{
+			follow_big_block_table( job.entry->start(), job.blocks );
+			if (!job.blocks.empty())
+				job.first = job.blocks[0];
+		}
+		order.push_back( &job );
+	}
+
+	// small streams are copied from the small-block container, read once
+	std::vector<unsigned char> mini;
+	if (small_streams && !direct_small_blocks() && !_sb_blocks.empty())
+	{
+		mini.resize( _sb_blocks.size() * bb_size );
+		mini.resize( loadBigBlocks( _sb_blocks, &mini[0], (ULONG32)mini.size() ) );
+	}
+
+	// start the reads in the order of the data in the file, to keep the
+	// workers close to each other
+	std::stable_sort( order.begin(), order.end(), first_in_file );
+	WorkerPool workers( threads );
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		const ExtractJob* job = order[i];
+		workers.post( [this, job, &mini, &callback, bb_size, sb_size]()
+		{
+			Extraction& item = *job->item;
+			ULONG32 len = job->entry->size();
+			if (item.data && item.size < len)
+				len = (ULONG32)item.size;
+			std::vector<unsigned char> buffer;
+			unsigned char* data = item.data;
+			if (!data)
+			{
+				buffer.resize( len ? len : 1 );
+				data = &buffer[0];
+			}
+
+			ULONG32 bytes = 0;
+			if (!job->small)
+				bytes = loadBigBlocks( job->blocks, data, len );
+			else if (mini.empty())
+				bytes = loadSmallBlocks( job->blocks, data, len );
+			else
+			{
+				for (size_t b = 0; ( b < job->blocks.size() ) && ( bytes < len ); b++)
+				{
+					size_t pos = (size_t)job->blocks[b] * sb_size;
+					if (pos + sb_size > mini.size())
+						break;
+					ULONG32 p = ( len-bytes < sb_size ) ? len-bytes : sb_size;
+					memcpy( data + bytes, &mini[pos], p );
+					bytes += p;
+				}
+			}
+
+			item.size = bytes;
+			if (!item.data && callback)
+				callback( item.path, data, bytes );
+		} );
+	}
+	workers.wait();
+	return result;
+}
+
+}
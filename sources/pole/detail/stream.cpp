@@ -40,7 +40,12 @@ StreamImpl::StreamImpl( const StreamImpl& stream)
 	_io = stream._io; 
     _entry = stream._entry; 
 	_blocks = stream._blocks;
+	_chains = stream._chains;
 	_pos = stream._pos;
+	_state = stream._state;
+	_next_read = stream._next_read;
+	_ahead_end = stream._ahead_end;
+	_ahead_size = stream._ahead_size;
 
 	_cache_size = stream._cache_size;
     _cache_pos = stream._cache_pos;
@@ -52,26 +57,42 @@ StreamImpl::StreamImpl( const StreamImpl& stream)
 void StreamImpl::init()
 {
   _pos = 0;
+  _state = 0;
+  _next_read = 0;
+  _ahead_end = 0;
+  _ahead_size = 0;
   // prepare cache
   _cache_pos = 0;
   _cache_size = 4096; // optimal ?
   _cache_data = new unsigned char[_cache_size];
 
+  _chains = 0;
+
   // sanity check
   if (!_entry) return;
 
-  if( _entry->size() >= _io->header()->threshold() ) 
-  {
-	  if (!_io->follow_big_block_table( _entry->start(), _blocks ))
-		  _state = StreamImpl::Bad;
-  }
-  else
-    if (!_io->follow_small_block_table( _entry->start(), _blocks ))
-		_state = StreamImpl::Bad;
+  if (!follow_blocks())
+    _state = StreamImpl::Bad;
 
   //update_cache();
 }
 
+// writes through other streams on the same entry may have grown or
+// moved its blocks since they were followed
+bool StreamImpl::follow_blocks()
+{
+  _chains = _io->chain_changes();
+  return follow_blocks( _blocks );
+}
+
+bool StreamImpl::follow_blocks( BlockChain& blocks ) const
+{
+  blocks.clear();
+  if( _entry->size() >= _io->header()->threshold() ) 
+    return _io->follow_big_block_table( _entry->start(), blocks );
+  return _io->follow_small_block_table( _entry->start(), blocks );
+}
+
 int StreamImpl::getch()
 {
   // sanity check
@@ -106,6 +127,7 @@ std::streamsize StreamImpl::read( size_t pos, unsigned char* data, std::streamsi
 	  return 0;
   if( maxlen == 0 ) 
 	  return 0;
+  refresh_blocks();
   if ((maxlen + pos) > _entry->size())
   {
 	  maxlen = _entry->size() - pos;
@@ -113,9 +135,32 @@ std::streamsize StreamImpl::read( size_t pos, unsigned char* data, std::streamsi
   }
   else
   {
-	  _state &= StreamImpl::Eof;
+	  _state &= ~StreamImpl::Eof;
   }
 
+  if ( _entry->size() >= _io->header()->threshold() )
+    readahead( pos, (size_t)maxlen );
+  return read_at( pos, data, maxlen );
+}
+
+// read without changing the state of the stream, several threads can
+// call it at once
+std::streamsize StreamImpl::read_at( size_t pos, unsigned char* data, std::streamsize maxlen ) const
+{
+  // sanity checks
+  if( !_entry || !data || maxlen <= 0 )
+	  return 0;
+  if( pos >= _entry->size() )
+	  return 0;
+  if( (size_t)maxlen > _entry->size() - pos )
+	  maxlen = _entry->size() - pos;
+
+  // _blocks is not refreshed here, other threads may be reading it
+  BlockChain fresh;
+  const BlockChain& blocks = ( _chains == _io->chain_changes() ) ? _blocks : fresh;
+  if( &blocks == &fresh && !follow_blocks( fresh ) )
+    return 0;
+
   std::streamsize totalbytes = 0;
   
   if ( _entry->size() < _io->header()->threshold() )
@@ -123,21 +168,28 @@ std::streamsize StreamImpl::read( size_t pos, unsigned char* data, std::streamsi
     // small file
     size_t index = pos / _io->small_block_size();
 
-    if( index >= _blocks.size() ) 
+    if( index >= blocks.size() ) 
 		return 0;
 
-    unsigned char* buf = new unsigned char[ _io->small_block_size() ];
+    // only needed when the block can't be copied from the file mapping
+    unsigned char* buf = NULL;
     size_t offset = pos % _io->small_block_size();
     while( totalbytes < maxlen )
     {
-      if( index >= _blocks.size() ) break;
-      ULONG32 read = _io->loadSmallBlock( _blocks[index], buf, _io->small_block_size() );
-	  if (read != _io->small_block_size())
-		  break;
+      if( index >= blocks.size() ) break;
+      const unsigned char* src = _io->smallBlockData( blocks[index] );
+      if( !src )
+      {
+        if( !buf ) buf = new unsigned char[ _io->small_block_size() ];
+        ULONG32 read = _io->loadSmallBlock( blocks[index], buf, _io->small_block_size() );
+        if (read != _io->small_block_size())
+          break;
+        src = buf;
+      }
       std::streamsize count = _io->small_block_size() - offset;
       if(count > (maxlen - totalbytes)) 
 		  count = maxlen - totalbytes;
-      memcpy(data + totalbytes, buf + offset, count);
+      memcpy(data + totalbytes, src + offset, count);
       totalbytes += count;
       offset = 0;
       index++;
@@ -147,29 +199,13 @@ std::streamsize StreamImpl::read( size_t pos, unsigned char* data, std::streamsi
   }
   else
   {
-    // big file
+    // big file, contiguous blocks are read straight into data
     size_t index = pos / _io->big_block_size();
     
-    if( index >= _blocks.size() ) 
+    if( index >= blocks.size() ) 
 		return 0;
-    
-    unsigned char* buf = new unsigned char[ _io->big_block_size() ];
-    size_t offset = pos % _io->big_block_size();
-    while( totalbytes < maxlen )
-    {
-      if( index >= _blocks.size() ) break;
-      ULONG32 read = _io->loadBigBlock( _blocks[index], buf, _io->big_block_size() );
-	  if (read != _io->big_block_size())
-		  break;
-      std::streamsize count = _io->big_block_size() - offset;
-      if( count > maxlen-totalbytes ) count = maxlen-totalbytes;
-      memcpy( data+totalbytes, buf + offset, count );
-      totalbytes += count;
-      index++;
-      offset = 0;
-    }
-    delete [] buf;
 
+    totalbytes = _io->loadBigBlocks( blocks, pos, data, (ULONG32)maxlen );
   }
 
   return totalbytes;
@@ -186,6 +222,119 @@ std::streamsize StreamImpl::read( unsigned char* data, std::streamsize maxlen )
   return bytes;
 }
 
+// fragments of the stream between pos and pos+maxlen: pointers into the
+// file mapping or the preloaded mini stream, otherwise a copy in _span_data
+std::streamsize StreamImpl::spans( size_t pos, std::streamsize maxlen, std::vector<Span>& result )
+{
+  result.clear();
+  if( !_entry )
+    return 0;
+  refresh_blocks();
+  if( pos >= _entry->size() )
+    return 0;
+  if( maxlen > (std::streamsize)( _entry->size() - pos ) )
+    maxlen = _entry->size() - pos;
+
+  bool small = ( _entry->size() < _io->header()->threshold() );
+  if( small ? !_io->direct_small_blocks() : !_io->mapped() )
+  {
+    _span_data.resize( (size_t)maxlen );
+    std::streamsize bytes = maxlen ? read( pos, &_span_data[0], maxlen ) : 0;
+    if( bytes > 0 )
+    {
+      Span s = { &_span_data[0], (size_t)bytes };
+      result.push_back( s );
+    }
+    return bytes;
+  }
+
+  ULONG32 block_size = small ? _io->small_block_size() : _io->big_block_size();
+  size_t index = pos / block_size;
+  size_t offset = pos % block_size;
+  if( index >= _blocks.size() )
+    return 0;
+
+  std::streamsize totalbytes = 0;
+  const std::vector<BlockChain::Extent>& extents = _blocks.extents();
+  size_t e = _blocks.find( index );
+  while( ( e < extents.size() ) && ( totalbytes < maxlen ) )
+  {
+    ULONG32 skip = (ULONG32)( index - extents[e].offset );
+    // big blocks of an extent follow each other in the mapping, small
+    // blocks only within the big block holding them
+    ULONG32 count = small ? 1 : extents[e].length - skip;
+    const unsigned char* src = small ? _io->smallBlockData( extents[e].start + skip )
+                                     : _io->bigBlockData( extents[e].start + skip, count );
+    if( !src )
+      break;
+
+    size_t bytes = (size_t)count * block_size - offset;
+    if( bytes > (size_t)( maxlen - totalbytes ) )
+      bytes = (size_t)( maxlen - totalbytes );
+    if( result.size() && ( result.back().data + result.back().size == src + offset ) )
+      result.back().size += bytes;
+    else
+    {
+      Span s = { src + offset, bytes };
+      result.push_back( s );
+    }
+    totalbytes += bytes;
+    offset = 0;
+
+    // small blocks are taken one at a time from their extent
+    index += count;
+    if( index >= extents[e].offset + extents[e].length )
+      e++;
+  }
+
+  return totalbytes;
+}
+
+// when reading in order, announce the data following the read to the
+// device before less than half of the window is left
+void StreamImpl::readahead( size_t pos, size_t len )
+{
+  size_t end = pos + len;
+  if( pos != _next_read )
+  {
+    // random access
+    _next_read = _ahead_end = end;
+    _ahead_size = 0;
+    return;
+  }
+  _next_read = end;
+  if( _ahead_end < end )
+    _ahead_end = end;
+
+  if( _ahead_size == 0 )
+    _ahead_size = MinReadahead;
+  else if( _ahead_end - end > _ahead_size / 2 )
+    return;
+  else if( _ahead_size < MaxReadahead )
+    _ahead_size *= 2;
+
+  size_t to = end + _ahead_size;
+  if( to > _entry->size() )
+    to = _entry->size();
+  if( to > _ahead_end )
+  {
+    _io->readahead( _blocks, _ahead_end, to - _ahead_end );
+    _ahead_end = to;
+  }
+}
+
+// queue a read on the workers of the storage
+void StreamImpl::read_async( size_t pos, unsigned char* data, std::streamsize maxlen, const std::function<void( std::streamsize )>& done ) const
+{
+  const StreamImpl* self = this;
+  _io->workers().post( [self, pos, data, maxlen, done]()
+  {
+    std::streamsize bytes = self->read_at( pos, data, maxlen );
+    if( done )
+      done( bytes );
+  } );
+}
+
 void StreamImpl::update_cache()
 {
   // sanity checks
@@ -220,91 +369,62 @@ POLE::ULONG32 StreamImpl::write(const unsigned char* data, POLE::ULONG32 maxlen)
 		return 0;
 	if(maxlen == 0) 
 		return 0;
+	refresh_blocks();
+
+	// Writing past the end grows the stream
 	if((maxlen + _pos) > _entry->size())
 	{
-		maxlen = (ULONG32)(_entry->size() - _pos);
-		_state |= StreamImpl::Eof;
-	}
-	else
-	{
-		_state &= StreamImpl::Eof;
+		if (!_io->resize(_entry, (ULONG32)(_pos + maxlen), _blocks))
+		{
+			_state |= StreamImpl::Bad;
+			return 0;
+		}
 	}
+	_state &= ~StreamImpl::Eof;
 
 	// Amount of written byes
-	ULONG32 written = 0;
 	ULONG32 count = 0;
-	ULONG32 data_len = maxlen;
 	
 	if (_entry->size() < _io->header()->threshold())
 	{// small file
-		std::vector<ULONG32> _sbroot_entry = _io->sb_blocks();
-		ULONG32 index = (ULONG32)(_pos / _io->small_block_size());
-
-		if(index > _sbroot_entry.size()) 
-			return 0;
-
-		ULONG32 offset = _pos % _io->small_block_size();
-
+		const ULONG32 block_size = _io->small_block_size();
+		size_t index = (size_t)(_pos / block_size);
+		ULONG32 offset = _pos % block_size;
 
 		for (; ((index < _blocks.size()) && (count < maxlen)); ++index)
 		{
-			// Take the minifat sector index
-			ULONG32 minifat_index = _blocks[index];
-			ULONG32 sbindex_offset = minifat_index % 8;
-			// Calculate the the root entry's big block index
-			ULONG32 position = minifat_index * _io->small_block_size();
-			ULONG32 bbindex = position / _io->big_block_size();
-			// Fisical offset inside the file
-			ULONG32 bbindice = _sbroot_entry[bbindex];
-			ULONG32 fisical_offset = (((bbindice * _io->big_block_size()) + _io->big_block_size()) + 
-								     (sbindex_offset * _io->small_block_size())) + offset;
-
 			// Amount of bytes that can actually be written
-			ULONG32 canwrite = _io->small_block_size() - offset;
-			if (canwrite > data_len )
-				canwrite = data_len;
+			ULONG32 canwrite = block_size - offset;
+			if (canwrite > maxlen - count)
+				canwrite = maxlen - count;
 
-			written = _io->saveBlock(fisical_offset, data, canwrite);
-			// HACK: In case of error what to do? quit?
-			if (written < canwrite)
-				return 0;
-			data += written;
-			data_len -= written;
+			ULONG32 written = _io->saveSmallBlock(_blocks[index], offset, data + count, canwrite);
 			count += written;
+			if (written < canwrite)
+				break;
 			offset = 0;
 		}
 	}
 	else
 	{// big file
-		// Ordinal of the first block for writing
-		ULONG32 index = (ULONG32)(_pos / _io->big_block_size());
-		if(index > _blocks.size()) 
-			return 0;
-		// Offset inside this block
-		ULONG32 offset = _pos % _io->big_block_size();
-
-		for (; ((index < _blocks.size()) && (count < maxlen)); ++index)
+		if (!_io->copy_on_write(_entry, _blocks, (size_t)_pos, maxlen))
 		{
-			// Fisical offset inside the file
-			ULONG32 fisical_offset = ((_blocks[index] * _io->big_block_size()) + _io->big_block_size() + offset);
-
-			// Amount of bytes that can actually be written
-			ULONG32 canwrite = _io->big_block_size() - offset;
-			if (canwrite > data_len )
-				canwrite = data_len;
-
-			written = _io->saveBlock(fisical_offset, data, canwrite);
-			// HACK: In case of error what to do? quit?
-			if (written < canwrite)
-				return 0;
-			data += written;
-			data_len -= written;
-			count += written;
-			offset = 0;
+			_state |= StreamImpl::Bad;
+			return 0;
 		}
+		count = _io->saveBigBlocks(_blocks, (size_t)_pos, data, maxlen);
 	}
-	return written;
+
+	// Keep the getch cache in sync with the written data
+	std::streamsize from = (_pos > _cache_pos) ? _pos : _cache_pos;
+	std::streamsize end = _pos + (std::streamsize)count;
+	std::streamsize to = (end < _cache_pos + _cache_size) ? end : _cache_pos + _cache_size;
+	if (from < to)
+		memcpy(_cache_data + (from - _cache_pos), data + (from - _pos), (size_t)(to - from));
+
+	_pos += count;
+	return count;
 }
 
 
-}
\ No newline at end of file
+}
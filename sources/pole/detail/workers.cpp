@@ -0,0 +1,88 @@
+/* POLE - Portable C++ library to access OLE Storage
+   Copyright (C) 2002-2004 Ariya Hidayat <ariya@kde.org>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, US
+*/
+
+
+#include "../../../includes/pole/detail/workers.hpp"
+
+namespace POLE
+{
+
+// =========== WorkerPool ==========
+
+WorkerPool::WorkerPool( unsigned threads ): _running(0), _stop(false)
+{
+	if (threads == 0)
+		threads = std::thread::hardware_concurrency();
+	if (threads == 0)
+		threads = 1;
+	for (unsigned i = 0; i < threads; i++)
+		_threads.push_back( std::thread( &WorkerPool::run, this ) );
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> guard( _lock );
+		_stop = true;
+	}
+	_ready.notify_all();
+	for (size_t i = 0; i < _threads.size(); i++)
+		_threads[i].join();
+}
+
+void WorkerPool::post( const std::function<void()>& task )
+{
+	{
+		std::lock_guard<std::mutex> guard( _lock );
+		_tasks.push_back( task );
+	}
+	_ready.notify_one();
+}
+
+void WorkerPool::wait()
+{
+	std::unique_lock<std::mutex> guard( _lock );
+	while (!_tasks.empty() || _running > 0)
+		_idle.wait( guard );
+}
+
+// worker loop, remaining tasks are run before stopping
+void WorkerPool::run()
+{
+	std::unique_lock<std::mutex> guard( _lock );
+	for (;;)
+	{
+		while (_tasks.empty() && !_stop)
+			_ready.wait( guard );
+		if (_tasks.empty())
+			return;
+
+		std::function<void()> task = _tasks.front();
+		_tasks.pop_front();
+		_running++;
+		guard.unlock();
+		task();
+		guard.lock();
+		_running--;
+		if (_tasks.empty() && _running == 0)
+			_idle.notify_all();
+	}
+}
+
+}
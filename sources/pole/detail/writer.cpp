@@ -0,0 +1,392 @@
+/* POLE - Portable C++ library to access OLE Storage
+   Copyright (C) 2002-2004 Ariya Hidayat <ariya@kde.org>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.LIB.  If not, write to
+   the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, US
+*/
+
+
+#include <algorithm>
+#include <string.h>
+#include "../../../includes/pole/detail/util.hpp"
+#include "../../../includes/pole/detail/header.hpp"
+#include "../../../includes/pole/detail/dirtree.hpp"
+#include "../../../includes/pole/detail/alloctable.hpp"
+#include "../../../includes/pole/detail/writer.hpp"
+
+namespace POLE
+{
+
+// =========== WriterIO ==========
+
+WriterIO::WriterIO( const char* filename )
+{
+	init();
+	FileDevice* file = new FileDevice();
+	if (!file->open( filename, true ))
+	{
+		delete file;
+		file = NULL;
+	}
+	attach( file, true );
+}
+
+#if defined(WIN32)
+WriterIO::WriterIO( const wchar_t* filename )
+{
+	init();
+	FileDevice* file = new FileDevice();
+	if (!file->open( filename, true ))
+	{
+		delete file;
+		file = NULL;
+	}
+	attach( file, true );
+}
+#endif
+
+WriterIO::WriterIO( BlockDevice* device )
+{
+	init();
+	attach( device, false );
+}
+
+WriterIO::~WriterIO()
+{
+	close();
+	if (_owned)
+		delete _device;
+	delete _sbat;
+	delete _bbat;
+	delete _dirtree;
+	delete _header;
+}
+
+void WriterIO::init()
+{
+	_device = NULL;
+	_owned = false;
+	_result = Ok;
+	_closed = false;
+	_header = new Header();
+	_dirtree = new DirTree();
+	_bbat = new AllocTable( 1 << _header->b_shift() );
+	_sbat = new AllocTable( 1 << _header->s_shift() );
+	_blocks = 0;
+	_small_blocks = 0;
+	_stream = DirTree::None;
+	_stream_size = 0;
+	_stream_start = AllocTable::Eof;
+	_stream_blocks = 0;
+	_written = 0;
+
+	// room for the header, written on close
+	_pending.assign( _bbat->block_size(), 0 );
+}
+
+void WriterIO::attach( BlockDevice* device, bool owned )
+{
+	_device = device;
+	_owned = owned;
+	if (!_device || !_device->good() || !_device->writable())
+		_result = OpenFailed;
+}
+
+// new entry of the given type at path, NULL if there is one already
+DirEntry* WriterIO::create( const std::string& path, ULONG8 type )
+{
+	if (_closed || _result != Ok || path.empty() || _stream != DirTree::None)
+		return NULL;
+	if (_dirtree->entry( path ))
+		return NULL;
+
+	// storages on the way may exist, but not streams
+	for (size_t end = path.find( '/', 1 ); end != std::string::npos; end = path.find( '/', end+1 ))
+	{
+		const DirEntry* e = _dirtree->entry( path.substr( 0, end ) );
+		if (e && !e->dir())
+			return NULL;
+	}
+
+	const DirEntry* e = _dirtree->entry( path, true );
+	if (!e)
+		return NULL;
+	DirEntry* entry = _dirtree->entry( e->index() );
+	entry->set_type( type );
+	return entry;
+}
+
+bool WriterIO::add( const std::string& path, const unsigned char* data, ULONG32 len )
+{
+	if (len > 0 && !data)
+		return false;
+	if (!open_stream( path ))
+		return false;
+	bool result = append( data, len );
+	return close_stream() && result;
+}
+
+bool WriterIO::open_stream( const std::string& path )
+{
+	DirEntry* e = create( path, 2 );
+	if (!e)
+		return false;
+	_stream = e->index();
+	_stream_size = 0;
+	_stream_start = AllocTable::Eof;
+	_stream_blocks = 0;
+	_head.clear();
+	return true;
+}
+
+bool WriterIO::append( const unsigned char* data, ULONG32 len )
+{
+	if (_stream == DirTree::None || _result != Ok)
+		return false;
+	if (len == 0)
+		return true;
+	if (!data || len > 0xffffffff - _stream_size)
+		return false;
+
+	// small streams are kept until they end or get big
+	if (_stream_size + len < _header->threshold())
+	{
+		_head.insert( _head.end(), data, data + len );
+		_stream_size += len;
+		return true;
+	}
+
+	if (!_head.empty() && !output( &_head[0], _head.size() ))
+	{
+		_result = WriteFailed;
+		return false;
+	}
+	_head.clear();
+	if (!output( data, len ))
+	{
+		_result = WriteFailed;
+		return false;
+	}
+
+	// extend the chain over the blocks reached by the data
+	const ULONG32 block_size = _bbat->block_size();
+	_stream_size += len;
+	ULONG32 count = (ULONG32)( ( (size_t)_stream_size + block_size-1 ) / block_size );
+	for (; _stream_blocks < count; _stream_blocks++, _blocks++)
+	{
+		_bbat->set( _blocks, AllocTable::Eof );
+		if (_stream_blocks)
+			_bbat->set( _blocks-1, _blocks );
+		else
+			_stream_start = _blocks;
+	}
+	return true;
+}
+
+bool WriterIO::close_stream()
+{
+	if (_stream == DirTree::None)
+		return false;
+	DirEntry* e = _dirtree->entry( _stream );
+	_stream = DirTree::None;
+	e->set_size( _stream_size );
+	if (_stream_size == 0)
+		e->set_start( AllocTable::Eof );
+	else if (_stream_blocks == 0)
+	{
+		// small streams are gathered in the container, written on close
+		const ULONG32 block_size = _sbat->block_size();
+		ULONG32 count = ( _stream_size + block_size-1 ) / block_size;
+		e->set_start( chain( _sbat, _small_blocks, count ) );
+		_small_blocks += count;
+		_mini.insert( _mini.end(), _head.begin(), _head.end() );
+		_mini.resize( (size_t)_small_blocks * block_size, 0 );
+	}
+	else
+	{
+		e->set_start( _stream_start );
+		pad();
+	}
+	_head.clear();
+	return _result == Ok;
+}
+
+bool WriterIO::add_storage( const std::string& path )
+{
+	return create( path, 1 ) != NULL;
+}
+
+bool WriterIO::close()
+{
+	if (_closed)
+		return _result == Ok;
+	if (_stream != DirTree::None)
+		close_stream();
+	_closed = true;
+	if (_result != Ok)
+		return false;
+
+	if (!saveMiniStream() || !saveTables() || !flush())
+	{
+		_result = WriteFailed;
+		return false;
+	}
+
+	unsigned char header[512];
+	if (!_header->save( header, 512 ) || _device->write_at( 0, header, 512 ) != 512)
+	{
+		_result = WriteFailed;
+		return false;
+	}
+	_device->flush();
+	return true;
+}
+
+// link count blocks from start, return the first one
+ULONG32 WriterIO::chain( AllocTable* table, ULONG32 start, ULONG32 count )
+{
+	for (ULONG32 i = 0; i < count; i++)
+		table->set( start+i, ( i+1 < count ) ? start+i+1 : AllocTable::Eof );
+	return count ? start : AllocTable::Eof;
+}
+
+// queue data, written by large chunks
+bool WriterIO::output( const unsigned char* data, size_t len )
+{
+	if (_pending.size() + len >= WriteBufferSize)
+	{
+		if (!flush())
+			return false;
+		if (len >= WriteBufferSize)
+		{
+			if (_device->write_at( _written, data, len ) != len)
+				return false;
+			_written += len;
+			return true;
+		}
+	}
+	_pending.insert( _pending.end(), data, data + len );
+	return true;
+}
+
+// complete the last block
+bool WriterIO::pad()
+{
+	const ULONG32 block_size = _bbat->block_size();
+	size_t rest = ( _written + _pending.size() ) % block_size;
+	if (rest)
+		_pending.resize( _pending.size() + block_size - rest, 0 );
+	return true;
+}
+
+bool WriterIO::flush()
+{
+	if (_pending.empty())
+		return true;
+	if (_device->write_at( _written, &_pending[0], _pending.size() ) != _pending.size())
+		return false;
+	_written += _pending.size();
+	_pending.clear();
+	return true;
+}
+
+// the small-block container and the small bat
+bool WriterIO::saveMiniStream()
+{
+	const ULONG32 block_size = _bbat->block_size();
+	DirEntry* root = _dirtree->entry( (size_t)0 );
+	root->set_size( (ULONG32)_mini.size() );
+	ULONG32 count = (ULONG32)( ( _mini.size() + block_size-1 ) / block_size );
+	root->set_start( chain( _bbat, _blocks, count ) );
+	_blocks += count;
+	if (count && ( !output( &_mini[0], _mini.size() ) || !pad() ))
+		return false;
+	std::vector<unsigned char>().swap( _mini );
+
+	count = ( _small_blocks*4 + block_size-1 ) / block_size;
+	_header->set_sbat_start( chain( _bbat, _blocks, count ) );
+	_header->set_num_sbat( count );
+	_blocks += count;
+	if (count)
+	{
+		std::vector<unsigned char> buffer( std::max( (size_t)count * block_size, _sbat->count() * 4 ), 0xff );
+		_sbat->save( &buffer[0], buffer.size() );
+		if (!output( &buffer[0], (size_t)count * block_size ))
+			return false;
+	}
+	return true;
+}
+
+// the directory, then the big bat and the meta bat
+bool WriterIO::saveTables()
+{
+	const ULONG32 block_size = _bbat->block_size();
+	const ULONG32 per_block = block_size / 4;
+
+	_dirtree->balance();
+	ULONG32 count = (ULONG32)( ( _dirtree->entryCount()*128 + block_size-1 ) / block_size );
+	_header->set_dirent_start( chain( _bbat, _blocks, count ) );
+	_blocks += count;
+	std::vector<unsigned char> buffer( (size_t)count * block_size );
+	if (!_dirtree->save( &buffer[0], buffer.size() ) || !output( &buffer[0], buffer.size() ))
+		return false;
+
+	// the big bat describes its own blocks and those of the meta bat,
+	// which lists the big bat blocks past the first 109
+	ULONG32 bat = 0, mbat = 0;
+	for (;;)
+	{
+		ULONG32 bat_needed = ( _blocks + bat + mbat + per_block-1 ) / per_block;
+		ULONG32 mbat_needed = ( bat_needed > 109 ) ? ( bat_needed-109 + per_block-2 ) / ( per_block-1 ) : 0;
+		if (bat_needed == bat && mbat_needed == mbat)
+			break;
+		bat = bat_needed;
+		mbat = mbat_needed;
+	}
+	for (ULONG32 i = 0; i < bat; i++)
+		_bbat->set( _blocks+i, AllocTable::Bat );
+	for (ULONG32 i = 0; i < mbat; i++)
+		_bbat->set( _blocks+bat+i, AllocTable::MetaBat );
+
+	buffer.assign( std::max( (size_t)bat * block_size, _bbat->count() * 4 ), 0xff );
+	_bbat->save( &buffer[0], buffer.size() );
+	if (!output( &buffer[0], (size_t)bat * block_size ))
+		return false;
+
+	for (ULONG32 m = 0; m < mbat; m++)
+	{
+		buffer.assign( block_size, 0xff );
+		for (ULONG32 s = 0; s < per_block-1; s++)
+		{
+			ULONG32 k = 109 + m * ( per_block-1 ) + s;
+			if (k >= bat)
+				break;
+			writeU32( &buffer[s*4], _blocks+k );
+		}
+		writeU32( &buffer[block_size-4], ( m+1 < mbat ) ? _blocks+bat+m+1 : AllocTable::Eof );
+		if (!output( &buffer[0], block_size ))
+			return false;
+	}
+
+	_header->set_num_bat( bat );
+	for (ULONG32 i = 0; i < 109; i++)
+		_header->set_bb_block( i, ( i < bat ) ? _blocks+i : AllocTable::Avail );
+	_header->set_mbat_start( mbat ? _blocks+bat : AllocTable::Eof );
+	_header->set_num_mbat( mbat );
+	_blocks += bat + mbat;
+	return true;
+}
+
+}
@@ -19,11 +19,16 @@
 
 
 #pragma warning( disable : 4267 ) // conversion from 'size_t' to 'unsigned int'
+#include "detail/filemap.cpp"
+#include "detail/cache.cpp"
+#include "detail/device.cpp"
+#include "detail/workers.cpp"
 #include "detail/header.cpp"
 #include "detail/alloctable.cpp"
 #include "detail/dirtree.cpp"
 #include "detail/storage.cpp"
 #include "detail/stream.cpp"
+#include "detail/writer.cpp"
 #pragma warning( default : 4267 ) // conversion from 'size_t' to 'unsigned int'
 
 #include "../../includes/pole/pole.h"
@@ -33,18 +38,28 @@ namespace POLE
 
 // =========== Storage ==========
 
-Storage::Storage( const char* filename )
+Storage::Storage( const char* filename, int mode )
 {
-  io = new StorageIO( filename );
+  io = new StorageIO( filename, mode );
 }
 
 #if defined(WIN32)
-Storage::Storage(const wchar_t* filename)
+Storage::Storage(const wchar_t* filename, int mode)
 {
-	io = new StorageIO(filename);
+	io = new StorageIO(filename, mode);
 }
 #endif
 
+Storage::Storage( BlockDevice* device, int mode )
+{
+  io = new StorageIO( device, mode );
+}
+
+Storage* Storage::from_memory( const void* data, size_t len )
+{
+  return new Storage( new StorageIO( data, len ) );
+}
+
 Storage::~Storage()
 {
   delete io;
@@ -92,6 +107,8 @@ Stream* Storage::stream( const std::string& name, bool reuse )
   path(path_);
   if( name[0] != '/' ) fullName.insert( 0, path_ + "/" );
   
+  std::lock_guard<std::mutex> guard( streams_lock );
+
   // If a stream for this path already exists return it
   if (reuse)
   {
@@ -126,6 +143,67 @@ bool Storage::delete_entry(const std::string& path)
 	return false; 
 }
 
+void Storage::flush()
+{
+  if (io)
+    io->flush();
+}
+
+bool Storage::commit()
+{
+  return io ? io->commit() : false;
+}
+
+void Storage::set_cache_size( unsigned long sectors )
+{
+  io->cache().set_capacity( sectors );
+}
+
+unsigned long Storage::cache_size() const
+{
+  return (unsigned long)io->cache().capacity();
+}
+
+unsigned long long Storage::cache_hits() const
+{
+  return io->cache().hits();
+}
+
+unsigned long long Storage::cache_misses() const
+{
+  return io->cache().misses();
+}
+
+void Storage::pin_metadata()
+{
+  io->pin_metadata();
+}
+
+bool Storage::extract( std::vector<Extraction>& streams, const ExtractCallback& callback, unsigned threads )
+{
+  if( !io ) return false;
+  return io->extract( streams, callback, threads );
+}
+
+bool Storage::extract( const std::function<bool( const std::string& path, const DirEntry& entry )>& filter,
+  const ExtractCallback& callback, unsigned threads )
+{
+  if( !io ) return false;
+
+  std::vector< std::pair<std::string, const DirEntry*> > entries;
+  io->listStreams( entries );
+  std::vector<Extraction> streams;
+  for( size_t i = 0; i < entries.size(); i++ )
+  {
+    if( !filter || filter( entries[i].first, *entries[i].second ) )
+    {
+      Extraction item = { entries[i].first, NULL, 0 };
+      streams.push_back( item );
+    }
+  }
+  return io->extract( streams, callback, threads );
+}
+
 
 // =========== Stream ==========
 
@@ -180,6 +258,40 @@ unsigned long Stream::read( unsigned char* data, unsigned long maxlen )
 #pragma warning( default : 4267 ) // conversion from 'size_t' to 'unsigned int'
 }
 
+unsigned long Stream::read_at( unsigned long pos, unsigned char* data, unsigned long maxlen ) const
+{
+  return impl ? (unsigned long)impl->read_at( pos, data, maxlen ) : 0;
+}
+
+unsigned long Stream::spans( unsigned long pos, unsigned long len, std::vector<Span>& result )
+{
+  if( !impl )
+  {
+    result.clear();
+    return 0;
+  }
+  return (unsigned long)impl->spans( pos, len, result );
+}
+
+std::future<unsigned long> Stream::read_async( unsigned long pos, unsigned char* data, unsigned long len )
+{
+  std::shared_ptr< std::promise<unsigned long> > result( new std::promise<unsigned long>() );
+  std::future<unsigned long> future = result->get_future();
+  read_async( pos, data, len, [result]( unsigned long bytes ) { result->set_value( bytes ); } );
+  return future;
+}
+
+void Stream::read_async( unsigned long pos, unsigned char* data, unsigned long len,
+  const std::function<void( unsigned long )>& done )
+{
+  if( !impl )
+  {
+    if( done ) done( 0 );
+    return;
+  }
+  impl->read_async( pos, data, len, [done]( std::streamsize bytes ) { if( done ) done( (unsigned long)bytes ); } );
+}
+
 Stream& Stream::write(const unsigned char* data, POLE::ULONG32 len)
 {
   //#pragma warning( disable : 4267 ) // conversion from 'size_t' to 'unsigned int'
@@ -190,4 +302,63 @@ Stream& Stream::write(const unsigned char* data, POLE::ULONG32 len)
   //#pragma warning( default : 4267 ) // conversion from 'size_t' to 'unsigned int'
 }
 
+// =========== Writer ==========
+
+Writer::Writer( const char* filename )
+{
+  io = new WriterIO( filename );
+}
+
+#if defined(WIN32)
+Writer::Writer( const wchar_t* filename )
+{
+  io = new WriterIO( filename );
+}
+#endif
+
+Writer::Writer( BlockDevice* device )
+{
+  io = new WriterIO( device );
+}
+
+Writer::~Writer()
+{
+  delete io;
+}
+
+int Writer::result() const
+{
+  return io->result();
+}
+
+bool Writer::add( const std::string& path, const unsigned char* data, unsigned long len )
+{
+  return io->add( path, data, (ULONG32)len );
+}
+
+bool Writer::add_storage( const std::string& path )
+{
+  return io->add_storage( path );
+}
+
+bool Writer::open_stream_for_write( const std::string& path )
+{
+  return io->open_stream( path );
+}
+
+bool Writer::append( const unsigned char* data, unsigned long len )
+{
+  return io->append( data, (ULONG32)len );
+}
+
+bool Writer::close_stream()
+{
+  return io->close_stream();
+}
+
+bool Writer::close()
+{
+  return io->close();
+}
+
 }
@@ -50,165 +50,235 @@ namespace ole
 			vec.push_back("/");
 			return vec;
 		}
+
+		// Path of the storage containing path, "/" for top level entries
+		std::string parent_path(const std::string& path)
+		{
+			size_t pos = path.find_last_of("/");
+			if (pos == 0 || pos == std::string::npos)
+				return "/";
+			return path.substr(0, pos);
+		}
 	}// namespce detail
 
 //=============compound_document===============
 
-	compound_document::compound_document(const std::string& filename): _storage(NULL), _good(false) 
+	compound_document::compound_document(const std::string& filename, int mode, bool lazy): 
+		_storage(NULL), _good(false), _lazy(lazy), _loaded(false), _all_expanded(false) 
 	{
 		if (filename.empty())
 			return;
 
-		_storage = new POLE::Storage(filename.c_str());
+		_storage = new POLE::Storage(filename.c_str(), mode);
 		if (!_storage || _storage->result() != POLE::Storage::Ok)
 			return;
 
-	    init();
+		if (!_lazy)
+			init();
 		/*if (_paths.size() == 0)
 			return;*/
 		_good = true;
 	}
 
 #if defined(WIN32)
-    compound_document::compound_document(const std::wstring& filename)
+    compound_document::compound_document(const std::wstring& filename, int mode, bool lazy):
+		_storage(NULL), _good(false), _lazy(lazy), _loaded(false), _all_expanded(false)
     {
 		if (filename.empty())
 			return;
 
-		_storage = new POLE::Storage(filename.c_str());
+		_storage = new POLE::Storage(filename.c_str(), mode);
 		if (!_storage || _storage->result() != POLE::Storage::Ok)
 			return;
 
-		init();
+		if (!_lazy)
+			init();
 		/*if (_paths.size() == 0)
 			return;*/
 		_good = true;
 	}
 #endif
 
+	compound_document::compound_document(POLE::BlockDevice* device, bool lazy):
+		_storage(NULL), _good(false), _lazy(lazy), _loaded(false), _all_expanded(false)
+	{
+		if (!device)
+			return;
+
+		_storage = new POLE::Storage(device);
+		if (!_storage || _storage->result() != POLE::Storage::Ok)
+			return;
+
+		if (!_lazy)
+			init();
+		_good = true;
+	}
+
+	compound_document* compound_document::from_memory(const void* data, size_t len, bool lazy)
+	{
+		return new compound_document((data && len) ? POLE::Storage::from_memory(data, len) : NULL, lazy);
+	}
+
+	compound_document::compound_document(POLE::Storage* storage, bool lazy):
+		_storage(storage), _good(false), _lazy(lazy), _loaded(false), _all_expanded(false)
+	{
+		if (!_storage || _storage->result() != POLE::Storage::Ok)
+			return;
+
+		if (!_lazy)
+			init();
+		_good = true;
+	}
+
     void compound_document::init()
+	{
+		_loaded = true;
+		if (!_storage)
+			return;
+
+		auto startIt = _storages.insert(_storages.begin(), ole::storage_path("/", this));
+		_storage_index[startIt->string()] = startIt;
+		if (!_lazy)
+			expand_all();
+	}
+
+	void compound_document::expand(ole::storage_path& storage)
 	{
 		typedef tree<ole::storage_path>::sibling_iterator Itr;
 
-		auto startIt = _storages.insert(_storages.begin(), ole::storage_path("/"));
+		storage._expanded = true;
+		auto index_it = _storage_index.find(storage.string());
+		if (index_it == _storage_index.end())
+			return;
+		Itr it = index_it->second;
+
+		std::vector<const POLE::DirEntry*> entries;
+		std::string storagePath = storage.string();
+		if (!_storage->enterDirectory(storagePath))
+			return;
+		_storage->listEntries(entries);
 
-		std::stack<Itr> items;
-		items.push(startIt);
+		for (auto entry_it = entries.begin(); entry_it != entries.end(); entry_it++)
+		{
+			std::string entry_path = storagePath;
+			if (entry_path[entry_path.size() - 1] != '/')
+				entry_path += "/";
+			entry_path += (*entry_it)->name();
+
+			if ((*entry_it)->type() == 1)
+			{
+				ole::storage_path spath(entry_path, this);
+				Itr _newit = _storages.append_child(it, spath);
+				_storage_index.insert(std::make_pair(entry_path, tree<ole::storage_path>::iterator(_newit)));
+			}
+			else if (_lazy)
+			{
+				storage.add_child(ole::stream_path(_storage, entry_path));
+			}
+			else
+			{
+				POLE::Stream* _defstream = _storage->stream(entry_path, true);
+				storage.add_child(ole::stream_path(_defstream, entry_path));
+			}
+		}
+		_storage->leaveDirectory();
+	}
+
+	void compound_document::expand_all()
+	{
+		typedef tree<ole::storage_path>::sibling_iterator Itr;
+
+		load();
+		if (_all_expanded)
+			return;
+		_all_expanded = true;
+		if (_storages.empty())
+			return;
 
+		std::stack<Itr> items;
+		items.push(_storages.begin());
 		while(!items.empty())
 		{
 			Itr it = items.top();
 			items.pop();
-			std::vector<const POLE::DirEntry*> entries;
-			std::string storagePath = it->string();
-			bool success = _storage->enterDirectory(storagePath);
-			if(success)
-			{
-				_storage->listEntries(entries);
-
-				for (auto entry_it = entries.begin(); entry_it != entries.end(); entry_it++)
-				{
-					std::string entry_path = storagePath;
-					if (entry_path[entry_path.size() - 1] != '/')
-						entry_path += "/";
-					entry_path += (*entry_it)->name();
-
-					if ((*entry_it)->type() == 1)
-					{
-						ole::storage_path spath(entry_path);
-						Itr _newit = _storages.append_child(it, spath);
-						items.push(_newit);
-					}
-					else
-					{
-						POLE::Stream* _defstream = _storage->stream(entry_path, true);
-						(*it).add_child(ole::stream_path(_defstream, entry_path));
-					}
-				}
-				_storage->leaveDirectory();
-			}
+			it->expand();
+			for (Itr child = _storages.begin(it); child != _storages.end(it); ++child)
+				items.push(child);
 		}
 	}
 
 	tree<ole::storage_path>::pre_order_iterator compound_document::find_storage(const std::string& storage_path)
 	{
-		ole::storage_preorder_iterator bit;
-		for(bit = _storages.begin();
-			bit != _storages.end();
-			bit++)
+		load();
+		// list the storages from the root down to storage_path
+		auto it = _storage_index.find("/");
+		size_t pos = 0;
+		while (it != _storage_index.end())
 		{
-			if (bit->string() == storage_path)
-				break;
+			it->second->expand();
+			if (pos == std::string::npos)
+				return it->second;
+			pos = storage_path.find('/', pos + 1);
+			it = _storage_index.find(storage_path.substr(0, pos));
 		}
-
-		return bit;
+		return _storages.end();
 	}
 
 	bool compound_document::path_exist(const std::string& path)
 	{
-		bool retval = false;
 		ole::storage_preorder_iterator it = find_storage(path);
 		if (it != _storages.end())// If the path match a storage
 			return true;
-		else// Path is not a storage, let try a "cd .." to find a storage again
-		{
-			std::string _child_tmp;
-			size_t pos = pos = path.find_last_of("/");
-			if (pos == 0)
-			{
-				if ((it = find_storage("/")) != _storages.end())
-					return it->path_exist(path);
-			}
-			if (pos > 0)
-			{
-				_child_tmp = path.substr(0, path.size() - ++pos);
-				if ((it = find_storage(_child_tmp)) != _storages.end())
-				{
-					return it->path_exist(path);
-				}
-			}
-		}
-		
-		return retval;
+		// Path is not a storage, let try a "cd .." to find a storage again
+		if ((it = find_storage(detail::parent_path(path))) != _storages.end())
+			return it->path_exist(path);
+		return false;
 	}
 
 	bool compound_document::entry_can_be_deleted(const std::string& path)
 	{
-		bool retval = false;
 		ole::storage_preorder_iterator it = find_storage(path);
 		if (it != _storages.end())// If the path match a storage
 			return true;
-		else// Path is not a storage, let try a "cd .." to find a storage again
+		// Path is not a storage, let try a "cd .." to find a storage again
+		if ((it = find_storage(detail::parent_path(path))) != _storages.end())
 		{
-			std::string _child_tmp;
-			size_t pos = pos = path.find_last_of("/");
-			if (pos == 0)
-			{
-				if ((it = find_storage("/")) != _storages.end())
-				{
-					for (ole::stream_iterator sit = it->begin();
-						sit != it->end(); sit++)
-					{
-						if (sit->string() == path)
-							return !sit->used();
-					}
-				}
-			}
-			if (pos > 0)
-			{
-				_child_tmp = path.substr(0, path.size() - pos);
-				if ((it = find_storage(_child_tmp)) != _storages.end())
-				{
-					for (ole::stream_iterator sit = it->begin();
-						sit != it->end(); sit++)
-					{
-						if (sit->string() == path)
-							return !sit->used();
-					}
-				}
-			}
+			ole::stream_iterator sit = it->find_stream(path);
+			if (sit != it->end())
+				return !sit->used();
+		}
+		return false;
+	}
+
+	bool compound_document::delete_entry(const std::string& path)
+	{
+		if (!_storage || !entry_can_be_deleted(path))
+			return false;
+		if (!_storage->delete_entry(path))
+			return false;
+		forget_entry(path);
+		return true;
+	}
+
+	void compound_document::forget_entry(const std::string& path)
+	{
+		ole::storage_preorder_iterator it = find_storage(path);
+		if (it == _storages.end())
+		{
+			if ((it = find_storage(detail::parent_path(path))) != _storages.end())
+				it->remove_stream(path);
+			return;
+		}
+
+		// the storage goes away with all the storages below it
+		std::string prefix = path + "/";
+		for (auto sit = _storage_index.begin(); sit != _storage_index.end(); )
+		{
+			if (sit->first == path || sit->first.compare(0, prefix.size(), prefix) == 0)
+				sit = _storage_index.erase(sit);
+			else
+				++sit;
 		}
-		
-		return retval;
+		_storages.erase(it);
 	}
 }
@@ -1,5 +1,14 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <set>
+#include <mutex>
+#include <thread>
 #include "polepp.hpp"
+#include "pole/detail/alloctable.hpp"
+#include "pole/detail/dirtree.hpp"
 #include "stream_utils.hpp"
 #include "test_data.hpp"
 
@@ -10,6 +19,25 @@ std::string getTestFilePath(const char* file_name)
     return path;
 }
 
+// Copy of a test file that tests are allowed to modify
+std::string copyTestFile(const char* file_name)
+{
+    std::string path = ::testing::TempDir() + file_name;
+    std::ifstream src(getTestFilePath(file_name).c_str(), std::ios::binary);
+    std::ofstream dst(path.c_str(), std::ios::binary | std::ios::trunc);
+    dst << src.rdbuf();
+    return path;
+}
+
+// Bytes of a test file, also written to device
+std::vector<unsigned char> loadTestDevice(const char* file_name, POLE::MemoryDevice& device)
+{
+    std::ifstream src(getTestFilePath(file_name).c_str(), std::ios::binary);
+    std::vector<unsigned char> bytes((std::istreambuf_iterator<char>(src)), std::istreambuf_iterator<char>());
+    device.write_at(0, bytes.data(), bytes.size());
+    return bytes;
+}
+
 TEST(compound_document, find_storage)
 {
     std::string file_path = getTestFilePath("test1.bin");
@@ -110,3 +138,988 @@ TEST(storage, read_stream_string)
     std::string key = ole::readOleString(contents_stream->stream());
     ASSERT_EQ(key, std::string("Scaling124"));
 }
+
+std::vector<char> readStream(ole::basic_stream stream, std::streamsize size)
+{
+    std::vector<char> data(size);
+    stream.seek(0, std::ios::beg);
+    data.resize(stream.read(data.data(), size));
+    return data;
+}
+
+TEST(storage, memory_mapped)
+{
+    std::string file_path = getTestFilePath("test2.bin");
+    ole::compound_document doc(file_path);
+    ole::compound_document mapped(file_path, POLE::Storage::MemoryMapped);
+    ASSERT_TRUE(doc.good());
+    ASSERT_TRUE(mapped.good());
+    auto storage = doc.find_storage("/Image/Item(0)");
+    auto mapped_storage = mapped.find_storage("/Image/Item(0)");
+    ASSERT_TRUE(mapped_storage != mapped.end());
+    auto contents = storage->find_stream("/Image/Item(0)/Contents");
+    auto mapped_contents = mapped_storage->find_stream("/Image/Item(0)/Contents");
+    ASSERT_TRUE(mapped_contents != mapped_storage->end());
+    std::vector<char> data = readStream(contents->stream(), 2887364);
+    EXPECT_EQ(data.size(), 2887364);
+    EXPECT_EQ(data, readStream(mapped_contents->stream(), 2887364));
+    auto root = doc.find_storage("/");
+    auto mapped_root = mapped.find_storage("/");
+    data = readStream(root->find_stream("/Tags")->stream(), 1518);
+    EXPECT_EQ(data.size(), 1518);
+    EXPECT_EQ(data, readStream(mapped_root->find_stream("/Tags")->stream(), 1518));
+}
+
+TEST(storage, read_unaligned)
+{
+    std::string file_path = getTestFilePath("test2.bin");
+    ole::compound_document doc(file_path);
+    ASSERT_TRUE(doc.good());
+    auto storage = doc.find_storage("/Image/Item(0)");
+    ASSERT_TRUE(storage != doc.end());
+    auto contents = storage->find_stream("/Image/Item(0)/Contents");
+    ASSERT_TRUE(contents != storage->end());
+    std::vector<char> data = readStream(contents->stream(), 2887364);
+    ASSERT_EQ(data.size(), 2887364);
+
+    ole::basic_stream stream = contents->stream();
+    std::vector<char> chunk(70001);
+    stream.seek(1000, std::ios::beg);
+    ASSERT_EQ(stream.read(chunk.data(), chunk.size()), chunk.size());
+    EXPECT_TRUE(std::equal(chunk.begin(), chunk.end(), data.begin() + 1000));
+    stream.seek(2887364 - 100, std::ios::beg);
+    EXPECT_EQ(stream.read(chunk.data(), chunk.size()), 100);
+    EXPECT_TRUE(std::equal(chunk.begin(), chunk.begin() + 100, data.end() - 100));
+}
+
+TEST(block_chain, extents)
+{
+    POLE::BlockChain chain;
+    const POLE::ULONG32 blocks[] = { 7, 8, 9, 3, 4, 20, 21, 22, 23 };
+    for (POLE::ULONG32 block : blocks)
+        chain.push_back(block);
+    ASSERT_EQ(chain.size(), 9);
+    ASSERT_EQ(chain.extents().size(), 3);
+    EXPECT_EQ(chain.extents()[2].offset, 5);
+    EXPECT_EQ(chain.extents()[2].length, 4);
+    for (size_t i = 0; i < chain.size(); i++)
+        EXPECT_EQ(chain[i], blocks[i]);
+    EXPECT_EQ(chain.find(0), 0);
+    EXPECT_EQ(chain.find(4), 1);
+    EXPECT_EQ(chain.find(8), 2);
+}
+
+TEST(alloc_table, load_save)
+{
+    unsigned char buffer[512];
+    for (unsigned i = 0; i < 128; i++)
+        POLE::writeU32(buffer + i * 4, i + 1);
+    POLE::writeU32(buffer + 4 * 4, POLE::AllocTable::Eof);
+    POLE::writeU32(buffer + 127 * 4, POLE::AllocTable::Avail);
+
+    POLE::AllocTable table(512);
+    ASSERT_TRUE(table.load(buffer, sizeof(buffer)));
+    ASSERT_EQ(table.count(), 128);
+    EXPECT_EQ(table[0], 1);
+    EXPECT_EQ(table[4], POLE::AllocTable::Eof);
+    EXPECT_EQ(table[127], POLE::AllocTable::Avail);
+    std::vector<POLE::ULONG32> chain;
+    ASSERT_TRUE(table.follow(0, chain));
+    EXPECT_EQ(chain.size(), 5);
+
+    unsigned char saved[512];
+    ASSERT_TRUE(table.save(saved, sizeof(saved)));
+    EXPECT_EQ(memcmp(buffer, saved, sizeof(buffer)), 0);
+}
+
+TEST(storage, directory_path)
+{
+    std::string file_path = getTestFilePath("test2.bin");
+    POLE::Storage storage(file_path.c_str());
+    ASSERT_EQ(storage.result(), POLE::Storage::Ok);
+    ASSERT_TRUE(storage.enterDirectory("/Image/Layers/Item(0)/Shapes"));
+    std::string path;
+    storage.path(path);
+    EXPECT_EQ(path, "/Image/Layers/Item(0)/Shapes");
+    storage.leaveDirectory();
+    storage.leaveDirectory();
+    storage.path(path);
+    EXPECT_EQ(path, "/Image/Layers");
+    storage.leaveDirectory();
+    storage.leaveDirectory();
+    storage.path(path);
+    EXPECT_EQ(path, "/");
+}
+
+TEST(storage, find_and_delete_entry)
+{
+    std::string file_path = copyTestFile("test2.bin");
+    {
+        POLE::Storage storage(file_path.c_str());
+        ASSERT_EQ(storage.result(), POLE::Storage::Ok);
+        EXPECT_TRUE(storage.stream("/Image/Tags/Contents") != NULL);
+        EXPECT_TRUE(storage.stream("/Image/Tags/Missing") == NULL);
+        ASSERT_TRUE(storage.enterDirectory("/Image"));
+        POLE::Stream* contents = storage.stream("Scaling/Contents");
+        ASSERT_TRUE(contents != NULL);
+        EXPECT_EQ(contents->size(), 330);
+
+        ASSERT_TRUE(storage.delete_entry("/Image/Tags"));
+        EXPECT_TRUE(storage.stream("/Image/Tags/Contents") == NULL);
+        EXPECT_TRUE(storage.stream("/Image/Scaling/Contents") != NULL);
+    }
+    POLE::Storage storage(file_path.c_str());
+    ASSERT_EQ(storage.result(), POLE::Storage::Ok);
+    EXPECT_TRUE(storage.stream("/Image/Tags/Contents") == NULL);
+    EXPECT_FALSE(storage.enterDirectory("/Image/Tags"));
+    EXPECT_TRUE(storage.stream("/Image/Item(0)/Tags/Contents") != NULL);
+}
+
+TEST(dir_entry, compare_names)
+{
+    EXPECT_LT(POLE::DirEntry::compare_names("Tags", "Image"), 0);
+    EXPECT_GT(POLE::DirEntry::compare_names("Contents", "Scaling"), 0);
+    EXPECT_LT(POLE::DirEntry::compare_names("Abc", "abd"), 0);
+    EXPECT_EQ(POLE::DirEntry::compare_names("Tags", "TAGS"), 0);
+}
+
+// black height of the tree at index, -1 if it is no sorted red-black tree
+static int checkSiblings(const POLE::DirTree& tree, POLE::ULONG32 index, const POLE::DirEntry* low, const POLE::DirEntry* high)
+{
+    if (index == POLE::DirEntry::End)
+        return 1;
+    const POLE::DirEntry* e = tree.entry(index);
+    if (!e || (low && POLE::DirEntry::compare_names(low->name(), e->name()) >= 0) ||
+        (high && POLE::DirEntry::compare_names(e->name(), high->name()) >= 0))
+        return -1;
+    if (e->color() == POLE::DirEntry::Red)
+        for (POLE::ULONG32 c : { e->prev(), e->next() })
+            if (c != POLE::DirEntry::End && tree.entry(c)->color() == POLE::DirEntry::Red)
+                return -1;
+    int left = checkSiblings(tree, e->prev(), low, e);
+    int right = checkSiblings(tree, e->next(), e, high);
+    if (left < 0 || left != right)
+        return -1;
+    return left + (e->color() == POLE::DirEntry::Black ? 1 : 0);
+}
+
+TEST(dir_tree, create_sorted)
+{
+    POLE::DirTree tree;
+    std::vector<std::string> names;
+    for (int i = 0; i < 300; i++)
+        names.push_back("Stream" + std::to_string((i * 7919) % 1000));
+    for (int i = 299; i >= 0; i--)
+        names.push_back("S" + std::to_string(i));
+    for (size_t i = 0; i < names.size(); i++)
+        ASSERT_TRUE(tree.entry("/Storage/" + names[i], true) != NULL);
+
+    const POLE::DirEntry* storage = tree.entry("/Storage");
+    ASSERT_TRUE(storage != NULL);
+    EXPECT_GT(checkSiblings(tree, storage->child(), NULL, NULL), 0);
+    for (size_t i = 0; i < names.size(); i++)
+        EXPECT_TRUE(tree.entry("/Storage/" + names[i]) != NULL);
+    EXPECT_TRUE(tree.entry("/Storage/Missing") == NULL);
+}
+
+TEST(compound_document, lazy)
+{
+    std::string file_path = getTestFilePath("test2.bin");
+    ole::compound_document doc(file_path);
+    ole::compound_document lazy(file_path, POLE::Storage::ReadWrite, true);
+    ASSERT_TRUE(lazy.good());
+    auto storage = lazy.find_storage("/Image/Scaling");
+    ASSERT_TRUE(storage != lazy.end());
+    auto contents = storage->find_stream("/Image/Scaling/Contents");
+    ASSERT_TRUE(contents != storage->end());
+    EXPECT_EQ(readStream(contents->stream(), 330),
+        readStream(doc.find_storage("/Image/Scaling")->find_stream("/Image/Scaling/Contents")->stream(), 330));
+
+    // the siblings of a storage found list their streams when used
+    auto image = lazy.find_storage("/Image");
+    auto eager = doc.find_storage("/Image");
+    ASSERT_EQ(std::distance(image.begin(), image.end()), std::distance(eager.begin(), eager.end()));
+    for (auto it = image.begin(), eit = eager.begin(); it != image.end(); ++it, ++eit)
+    {
+        EXPECT_EQ(it->string(), eit->string());
+        EXPECT_EQ(std::distance(it->begin(), it->end()), std::distance(eit->begin(), eit->end()));
+    }
+    EXPECT_TRUE(lazy.path_exist("/Image/Layers/Item(0)/Shapes"));
+
+    size_t storages = 0, streams = 0;
+    for (auto it = lazy.begin(); it != lazy.end(); ++it, ++storages)
+        streams += std::distance(it->begin(), it->end());
+    EXPECT_EQ(storages, 12);
+    EXPECT_EQ(streams, 15);
+}
+
+TEST(compound_document, delete_entry)
+{
+    std::string file_path = copyTestFile("test2.bin");
+    ole::compound_document doc(file_path);
+    ASSERT_TRUE(doc.good());
+    EXPECT_TRUE(doc.path_exist("/Image/Scaling/Tags"));
+    EXPECT_TRUE(doc.path_exist("/Image/Scaling/Tags/Contents"));
+    EXPECT_TRUE(doc.path_exist("/Image/Scaling/Contents"));
+    EXPECT_FALSE(doc.path_exist("/Image/Scaling/Missing"));
+
+    ASSERT_TRUE(doc.delete_entry("/Image/Scaling/Tags"));
+    EXPECT_FALSE(doc.path_exist("/Image/Scaling/Tags"));
+    EXPECT_FALSE(doc.path_exist("/Image/Scaling/Tags/Contents"));
+    EXPECT_TRUE(doc.find_storage("/Image/Scaling/Tags") == doc.end());
+    EXPECT_TRUE(doc.path_exist("/Image/Scaling/Contents"));
+
+    ASSERT_TRUE(doc.delete_entry("/Tags"));
+    EXPECT_FALSE(doc.path_exist("/Tags"));
+    auto root = doc.find_storage("/");
+    EXPECT_TRUE(root->find_stream("/Tags") == root->end());
+    EXPECT_TRUE(root->find_stream("/Thumbnail") != root->end());
+    EXPECT_EQ(std::distance(root->begin(), root->end()), 3);
+}
+
+std::vector<char> joinSpans(const std::vector<POLE::Span>& spans)
+{
+    std::vector<char> data;
+    for (const POLE::Span& span : spans)
+        data.insert(data.end(), span.data, span.data + span.size);
+    return data;
+}
+
+TEST(storage, spans)
+{
+    std::string file_path = getTestFilePath("test2.bin");
+    for (int mode : { POLE::Storage::ReadWrite, POLE::Storage::MemoryMapped })
+    {
+        ole::compound_document doc(file_path, mode);
+        ASSERT_TRUE(doc.good());
+        auto storage = doc.find_storage("/Image/Item(0)");
+        ole::basic_stream big = storage->find_stream("/Image/Item(0)/Contents")->stream();
+        std::vector<char> data = readStream(big, 2887364);
+        std::vector<POLE::Span> spans;
+        EXPECT_EQ(big.spans(1000, 100000, spans), 100000);
+        EXPECT_TRUE(std::equal(data.begin() + 1000, data.begin() + 101000, joinSpans(spans).begin()));
+        EXPECT_EQ(big.spans(2887364 - 10, 100, spans), 10);
+        EXPECT_EQ(joinSpans(spans).size(), 10);
+
+        auto root = doc.find_storage("/");
+        ole::basic_stream small = root->find_stream("/Tags")->stream();
+        data = readStream(small, 1518);
+        EXPECT_EQ(small.spans(70, 1000, spans), 1000);
+        std::vector<char> joined = joinSpans(spans);
+        ASSERT_EQ(joined.size(), 1000);
+        EXPECT_TRUE(std::equal(joined.begin(), joined.end(), data.begin() + 70));
+    }
+}
+
+TEST(storage, preload_mini_stream)
+{
+    std::string file_path = copyTestFile("test2.bin");
+    POLE::Storage plain(file_path.c_str());
+    POLE::Storage preloaded(file_path.c_str(), POLE::Storage::PreloadMiniStream);
+    ASSERT_EQ(preloaded.result(), POLE::Storage::Ok);
+    for (const char* name : { "/Tags", "/Image/Scaling/Contents" })
+    {
+        POLE::Stream* a = plain.stream(name);
+        POLE::Stream* b = preloaded.stream(name);
+        ASSERT_TRUE(a != NULL && b != NULL);
+        std::vector<unsigned char> expected(a->size()), data(b->size());
+        EXPECT_EQ(a->read(expected.data(), expected.size()), expected.size());
+        EXPECT_EQ(b->read(data.data(), data.size()), data.size());
+        EXPECT_EQ(data, expected);
+
+        std::vector<POLE::Span> spans;
+        EXPECT_EQ(b->spans(10, 200, spans), 200);
+        EXPECT_EQ(joinSpans(spans), std::vector<char>(expected.begin() + 10, expected.begin() + 210));
+    }
+
+    // writes go to the preloaded copy too
+    POLE::Stream* tags = preloaded.stream("/Tags");
+    const unsigned char patch[4] = { 1, 2, 3, 4 };
+    tags->seek(100);
+    tags->write(patch, 4);
+    unsigned char check[4] = { 0 };
+    tags->seek(100);
+    EXPECT_EQ(tags->read(check, 4), 4);
+    EXPECT_TRUE(std::equal(patch, patch + 4, check));
+}
+
+TEST(storage, block_devices)
+{
+    std::string file_path = getTestFilePath("test2.bin");
+    ole::compound_document doc(file_path);
+    ASSERT_TRUE(doc.good());
+    std::vector<char> expected = readStream(doc.find_storage("/Image/Item(0)")->find_stream("/Image/Item(0)/Contents")->stream(), 2887364);
+
+    POLE::MemoryDevice memory;
+    std::vector<unsigned char> bytes = loadTestDevice("test2.bin", memory);
+    EXPECT_EQ(memory.size(), bytes.size());
+    POLE::FileDevice file;
+    ASSERT_TRUE(file.open(file_path.c_str()));
+    POLE::MappedDevice mapped;
+    ASSERT_TRUE(mapped.open(file_path.c_str()));
+    POLE::StreamDevice stream;
+    ASSERT_TRUE(stream.open(copyTestFile("test2.bin").c_str()));
+
+    for (POLE::BlockDevice* device : std::vector<POLE::BlockDevice*>{ &memory, &file, &mapped, &stream })
+    {
+        EXPECT_EQ(device->size(), bytes.size());
+        ole::compound_document other(device);
+        ASSERT_TRUE(other.good());
+        auto storage = other.find_storage("/Image/Item(0)");
+        ASSERT_TRUE(storage != other.end());
+        EXPECT_EQ(readStream(storage->find_stream("/Image/Item(0)/Contents")->stream(), 2887364), expected);
+    }
+}
+
+TEST(compound_document, from_buffer)
+{
+    std::string file_path = getTestFilePath("test2.bin");
+    std::ifstream src(file_path.c_str(), std::ios::binary);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(src)), std::istreambuf_iterator<char>());
+    std::unique_ptr<ole::compound_document> doc(ole::compound_document::from_memory(bytes.data(), bytes.size()));
+    ASSERT_TRUE(doc->good());
+    auto root = doc->find_storage("/");
+    ASSERT_TRUE(root != doc->end());
+    ole::basic_stream tags = root->find_stream("/Tags")->stream();
+    std::vector<POLE::Span> spans;
+    EXPECT_EQ(tags.spans(0, 1518, spans), 1518);
+    ASSERT_FALSE(spans.empty());
+    // data is read in place
+    EXPECT_GE((const char*)spans[0].data, bytes.data());
+    EXPECT_LT((const char*)spans[0].data, bytes.data() + bytes.size());
+
+    ole::compound_document file(file_path);
+    EXPECT_EQ(readStream(tags, 1518), readStream(file.find_storage("/")->find_stream("/Tags")->stream(), 1518));
+
+    std::unique_ptr<POLE::Storage> storage(POLE::Storage::from_memory(bytes.data(), 100));
+    EXPECT_NE(storage->result(), POLE::Storage::Ok);
+}
+
+TEST(storage, concurrent_readers)
+{
+    std::string file_path = getTestFilePath("test2.bin");
+    const char* names[] = { "/Image/Item(0)/Contents", "/Thumbnail", "/Tags", "/Image/Scaling/Contents" };
+    std::vector<std::vector<unsigned char> > expected;
+    {
+        POLE::Storage storage(file_path.c_str());
+        for (const char* name : names)
+        {
+            POLE::Stream* s = storage.stream(name);
+            ASSERT_TRUE(s != NULL);
+            expected.push_back(std::vector<unsigned char>(s->size()));
+            s->read(expected.back().data(), expected.back().size());
+        }
+    }
+
+    std::fstream file(copyTestFile("test2.bin").c_str(), std::ios::binary | std::ios::in | std::ios::out);
+    POLE::StreamDevice device(&file);
+    POLE::Storage from_file(file_path.c_str());
+    POLE::Storage from_stream(&device);
+    for (POLE::Storage* storage : { &from_file, &from_stream })
+    {
+        ASSERT_EQ(storage->result(), POLE::Storage::Ok);
+        std::vector<std::thread> threads;
+        std::vector<int> matches(8, 0);
+        for (size_t t = 0; t < matches.size(); t++)
+            threads.push_back(std::thread([&, t]() {
+                size_t n = t % 4;
+                POLE::Stream* s = storage->stream(names[n]);
+                std::vector<unsigned char> data(s->size());
+                // read in small pieces to interleave with the other threads
+                for (unsigned long pos = 0; pos < data.size(); pos += 4000)
+                    s->read(data.data() + pos, std::min<unsigned long>(4000, data.size() - pos));
+                matches[t] = (data == expected[n]);
+            }));
+        for (std::thread& thread : threads)
+            thread.join();
+        EXPECT_EQ(std::count(matches.begin(), matches.end(), 1), 8);
+    }
+}
+
+TEST(storage, extract)
+{
+    std::string file_path = getTestFilePath("test2.bin");
+    POLE::Storage storage(file_path.c_str());
+    ASSERT_EQ(storage.result(), POLE::Storage::Ok);
+
+    // every stream through the callback
+    std::mutex lock;
+    std::map<std::string, std::vector<unsigned char> > extracted;
+    EXPECT_TRUE(storage.extract([](const std::string&, const POLE::DirEntry&) { return true; },
+        [&](const std::string& path, const unsigned char* data, unsigned long size) {
+            std::lock_guard<std::mutex> guard(lock);
+            extracted[path].assign(data, data + size);
+        }, 4));
+    EXPECT_EQ(extracted.size(), 15);
+    for (auto& item : extracted)
+    {
+        POLE::Stream* s = storage.stream(item.first);
+        ASSERT_TRUE(s != NULL);
+        std::vector<unsigned char> data(s->size());
+        s->read(data.data(), data.size());
+        EXPECT_EQ(item.second, data) << item.first;
+    }
+
+    // into caller buffers
+    std::vector<unsigned char> tags(2000), contents(100);
+    std::vector<POLE::Extraction> streams = {
+        { "/Tags", tags.data(), (unsigned long)tags.size() },
+        { "/Image/Item(0)/Contents", contents.data(), (unsigned long)contents.size() },
+        { "/Image/Missing", NULL, 0 } };
+    EXPECT_FALSE(storage.extract(streams));
+    EXPECT_EQ(streams[0].size, 1518);
+    EXPECT_EQ(streams[1].size, 100);
+    EXPECT_TRUE(std::equal(tags.begin(), tags.begin() + 1518, extracted["/Tags"].begin()));
+    EXPECT_TRUE(std::equal(contents.begin(), contents.end(), extracted["/Image/Item(0)/Contents"].begin()));
+}
+
+TEST(storage, sector_cache)
+{
+    std::string file_path = getTestFilePath("test2.bin");
+    POLE::Storage storage(file_path.c_str());
+    ASSERT_EQ(storage.result(), POLE::Storage::Ok);
+    POLE::Stream* tags = storage.stream("/Tags");
+    ASSERT_TRUE(tags != NULL);
+    std::vector<unsigned char> expected(tags->size());
+    ASSERT_EQ(tags->read(expected.data(), expected.size()), expected.size());
+
+    // small blocks of one sector are served from memory after the first one
+    unsigned long long hits = storage.cache_hits();
+    std::vector<unsigned char> data(tags->size());
+    tags->seek(0);
+    EXPECT_EQ(tags->read(data.data(), data.size()), data.size());
+    EXPECT_EQ(data, expected);
+    EXPECT_GT(storage.cache_hits(), hits);
+
+    POLE::Stream* contents = storage.stream("/Image/Item(0)/Contents");
+    unsigned char bytes[16], again[16];
+    contents->seek(100000);
+    contents->read(bytes, 16);
+    unsigned long long misses = storage.cache_misses();
+    contents->seek(100000);
+    contents->read(again, 16);
+    EXPECT_EQ(storage.cache_misses(), misses);
+    EXPECT_TRUE(std::equal(bytes, bytes + 16, again));
+
+    // pinned sectors stay without a cache size
+    storage.pin_metadata();
+    storage.set_cache_size(0);
+    EXPECT_EQ(storage.cache_size(), 0);
+    tags->seek(0);
+    tags->read(data.data(), data.size());
+    misses = storage.cache_misses();
+    tags->seek(0);
+    tags->read(data.data(), data.size());
+    EXPECT_EQ(storage.cache_misses(), misses);
+    EXPECT_EQ(data, expected);
+}
+
+// memory device recording the readahead hints
+class AdvisedDevice : public POLE::MemoryDevice
+{
+public:
+    void advise(size_t pos, size_t len) { advised += len; last = pos + len; }
+    size_t advised = 0;
+    size_t last = 0;
+};
+
+TEST(stream, readahead)
+{
+    AdvisedDevice device;
+    std::vector<unsigned char> bytes = loadTestDevice("test2.bin", device);
+    POLE::Storage storage(&device);
+    ASSERT_EQ(storage.result(), POLE::Storage::Ok);
+    POLE::Stream* contents = storage.stream("/Image/Item(0)/Contents");
+    ASSERT_TRUE(contents != NULL);
+
+    // random reads are not announced
+    std::vector<unsigned char> chunk(0x10000);
+    contents->seek(1000000);
+    contents->read(chunk.data(), 100);
+    contents->seek(5000);
+    contents->read(chunk.data(), 100);
+    EXPECT_EQ(device.advised, 0);
+
+    // reading in order keeps the window ahead of the reads
+    contents->seek(0);
+    unsigned long total = 0;
+    while (unsigned long n = contents->read(chunk.data(), chunk.size()))
+    {
+        total += n;
+        // from the second read on, at least half the initial window ahead
+        if (total > chunk.size() && total < 2000000)
+            EXPECT_GE(device.advised, total - chunk.size() + 0x10000);
+    }
+    EXPECT_EQ(total, 2887364);
+    EXPECT_LE(device.advised, 2887364);
+    EXPECT_LE(device.last, bytes.size());
+}
+
+TEST(stream, read_async)
+{
+    std::string file_path = getTestFilePath("test2.bin");
+    ole::compound_document doc(file_path);
+    ASSERT_TRUE(doc.good());
+    ole::basic_stream contents = doc.find_storage("/Image/Item(0)")->find_stream("/Image/Item(0)/Contents")->stream();
+    std::vector<char> expected = readStream(contents, 2887364);
+    contents.seek(1234, std::ios::beg);
+
+    // many reads in flight at once
+    const size_t count = 16, len = 100000;
+    std::vector<std::vector<char> > buffers(count, std::vector<char>(len));
+    std::vector<std::future<unsigned long> > results;
+    for (size_t i = 0; i < count; i++)
+        results.push_back(contents.read_async(i * 150000, buffers[i].data(), len));
+    for (size_t i = 0; i < count; i++)
+    {
+        unsigned long expected_len = std::min<unsigned long>(len, 2887364 - i * 150000);
+        EXPECT_EQ(results[i].get(), expected_len);
+        EXPECT_TRUE(std::equal(buffers[i].begin(), buffers[i].begin() + expected_len, expected.begin() + i * 150000));
+    }
+    EXPECT_EQ(contents.pos(), 1234);
+
+    // completion callback
+    std::promise<unsigned long> done;
+    std::vector<char> tags(2000);
+    ole::basic_stream small = doc.find_storage("/")->find_stream("/Tags")->stream();
+    small.read_async(18, tags.data(), tags.size(), [&done](unsigned long bytes) { done.set_value(bytes); });
+    EXPECT_EQ(done.get_future().get(), 1500);
+    small.seek(18, std::ios::beg);
+    std::vector<char> check(1500);
+    small.read(check.data(), 1500);
+    EXPECT_TRUE(std::equal(check.begin(), check.end(), tags.begin()));
+}
+
+TEST(stream, read_at)
+{
+    std::string file_path = getTestFilePath("test2.bin");
+    ole::compound_document doc(file_path);
+    ASSERT_TRUE(doc.good());
+    ole::basic_stream contents = doc.find_storage("/Image/Item(0)")->find_stream("/Image/Item(0)/Contents")->stream();
+    ole::basic_stream tags = doc.find_storage("/")->find_stream("/Tags")->stream();
+    std::vector<char> big = readStream(contents, 2887364);
+    std::vector<char> small = readStream(tags, 1518);
+    contents.seek(10, std::ios::beg);
+    tags.seek(20, std::ios::beg);
+
+    // records fetched from the same handles by several threads
+    std::vector<std::thread> threads;
+    std::vector<int> matches(8, 0);
+    for (size_t t = 0; t < matches.size(); t++)
+        threads.push_back(std::thread([&, t]() {
+            bool same = true;
+            char record[333];
+            for (std::streamoff pos = t * 7; pos < 1518; pos += 333 + t)
+            {
+                std::streamsize n = tags.read_at(pos, record, sizeof(record));
+                same = same && n == std::min<std::streamsize>(333, 1518 - pos) && std::equal(record, record + n, small.begin() + pos);
+            }
+            for (std::streamoff pos = t * 1000; pos < 2887364; pos += 77777)
+            {
+                std::streamsize n = contents.read_at(pos, record, sizeof(record));
+                same = same && n == std::min<std::streamsize>(333, 2887364 - pos) && std::equal(record, record + n, big.begin() + pos);
+            }
+            matches[t] = same;
+        }));
+    for (std::thread& thread : threads)
+        thread.join();
+    EXPECT_EQ(std::count(matches.begin(), matches.end(), 1), 8);
+    EXPECT_EQ(contents.pos(), 10);
+    EXPECT_EQ(tags.pos(), 20);
+    EXPECT_FALSE(tags.eof());
+    char byte;
+    EXPECT_EQ(tags.read_at(1518, &byte, 1), 0);
+}
+
+std::vector<unsigned char> readAll(POLE::Stream* stream)
+{
+    std::vector<unsigned char> data(stream->size());
+    if (!data.empty())
+        data.resize(stream->read_at(0, &data[0], data.size()));
+    return data;
+}
+
+bool allStreams(const std::string&, const POLE::DirEntry&)
+{
+    return true;
+}
+
+TEST(stream, write_past_end)
+{
+    std::string file_path = copyTestFile("test2.bin");
+    std::map<std::string, std::vector<unsigned char>> before, after;
+    std::vector<unsigned char> tail(100000);
+    for (size_t i = 0; i < tail.size(); i++)
+        tail[i] = (unsigned char)(i * 7 + i / 251);
+    {
+        POLE::Storage storage(file_path.c_str());
+        ASSERT_EQ(storage.result(), POLE::Storage::Ok);
+        storage.extract(allStreams, [&](const std::string& path, const unsigned char* data, unsigned long size) {
+            before[path].assign(data, data + size);
+        }, 1);
+        ASSERT_EQ(before.size(), 15);
+
+        // stays in small blocks
+        POLE::Stream* tags = storage.stream("/Tags");
+        tags->seek(1518);
+        tags->write(&tail[0], 1000);
+        EXPECT_EQ(tags->tell(), 2518);
+        EXPECT_EQ(tags->size(), 2518);
+        after["/Tags"] = before["/Tags"];
+        after["/Tags"].insert(after["/Tags"].end(), tail.begin(), tail.begin() + 1000);
+
+        // moves to big blocks, written across the old end
+        POLE::Stream* contents = storage.stream("/Image/Scaling/Contents");
+        contents->seek(300);
+        contents->write(&tail[0], 5000);
+        EXPECT_EQ(contents->size(), 5300);
+        after["/Image/Scaling/Contents"] = before["/Image/Scaling/Contents"];
+        after["/Image/Scaling/Contents"].resize(300);
+        after["/Image/Scaling/Contents"].insert(after["/Image/Scaling/Contents"].end(), tail.begin(), tail.begin() + 5000);
+        EXPECT_EQ(readAll(contents), after["/Image/Scaling/Contents"]);
+
+        POLE::Stream* thumbnail = storage.stream("/Thumbnail");
+        thumbnail->seek(36942);
+        thumbnail->write(&tail[0], (POLE::ULONG32)tail.size());
+        EXPECT_EQ(thumbnail->size(), 136942);
+        after["/Thumbnail"] = before["/Thumbnail"];
+        after["/Thumbnail"].insert(after["/Thumbnail"].end(), tail.begin(), tail.end());
+    }
+
+    POLE::Storage storage(file_path.c_str());
+    ASSERT_EQ(storage.result(), POLE::Storage::Ok);
+    std::map<std::string, std::vector<unsigned char>> reopened;
+    std::mutex lock;
+    EXPECT_TRUE(storage.extract(allStreams, [&](const std::string& path, const unsigned char* data, unsigned long size) {
+        std::lock_guard<std::mutex> guard(lock);
+        reopened[path].assign(data, data + size);
+    }, 2));
+    ASSERT_EQ(reopened.size(), 15);
+    for (const auto& it : before)
+    {
+        const std::vector<unsigned char>& expected = after.count(it.first) ? after[it.first] : it.second;
+        EXPECT_TRUE(reopened[it.first] == expected) << it.first;
+    }
+}
+
+TEST(writer, add_streams)
+{
+    std::map<std::string, std::vector<unsigned char>> streams;
+    std::vector<std::string> names = { "/Small", "/Empty", "/Dir/Big", "/Dir/Sub/Exact", "/Dir/Sub/Below" };
+    std::vector<size_t> sizes = { 100, 0, 10000, 4096, 4095 };
+    for (int i = 0; i < 40; i++)
+    {
+        names.push_back("/Many/Stream" + std::to_string(i * 7 % 40));
+        sizes.push_back(i * 397 % 6000);
+    }
+
+    POLE::MemoryDevice device;
+    {
+        POLE::Writer writer(&device);
+        ASSERT_EQ(writer.result(), POLE::Writer::Ok);
+        for (size_t i = 0; i < names.size(); i++)
+        {
+            std::vector<unsigned char>& data = streams[names[i]];
+            for (size_t j = 0; j < sizes[i]; j++)
+                data.push_back((unsigned char)(i + j * 13));
+            EXPECT_TRUE(writer.add(names[i], data.data(), (unsigned long)data.size())) << names[i];
+        }
+        EXPECT_TRUE(writer.add_storage("/Folder"));
+        EXPECT_FALSE(writer.add("/Small", (const unsigned char*)"x", 1));
+        EXPECT_FALSE(writer.add("/Small/Child", (const unsigned char*)"x", 1));
+        EXPECT_TRUE(writer.close());
+    }
+    EXPECT_EQ(device.size() % 512, 0);
+
+    std::unique_ptr<POLE::Storage> storage(POLE::Storage::from_memory(device.data(), device.size()));
+    ASSERT_EQ(storage->result(), POLE::Storage::Ok);
+    std::map<std::string, std::vector<unsigned char>> read;
+    std::mutex lock;
+    EXPECT_TRUE(storage->extract(allStreams, [&](const std::string& path, const unsigned char* data, unsigned long size) {
+        std::lock_guard<std::mutex> guard(lock);
+        read[path].assign(data, data + size);
+    }, 2));
+    EXPECT_EQ(read.size(), streams.size());
+    for (const std::string& name : names)
+    {
+        EXPECT_TRUE(read[name] == streams[name]) << name;
+        EXPECT_TRUE(storage->stream(name) != NULL) << name;
+    }
+    EXPECT_TRUE(storage->enterDirectory("/Folder"));
+}
+
+TEST(writer, big_file)
+{
+    // more than 109 sectors of big bat, listed by the meta bat
+    std::string file_path = ::testing::TempDir() + "writer.bin";
+    std::vector<unsigned char> data(9000000);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (unsigned char)(i % 251);
+    {
+        POLE::Writer writer(file_path.c_str());
+        ASSERT_EQ(writer.result(), POLE::Writer::Ok);
+        EXPECT_TRUE(writer.add("/Data", data.data(), (unsigned long)data.size()));
+        EXPECT_TRUE(writer.add("/Tail", data.data(), 10));
+    }
+
+    POLE::Storage storage(file_path.c_str());
+    ASSERT_EQ(storage.result(), POLE::Storage::Ok);
+    POLE::Stream* stream = storage.stream("/Data");
+    ASSERT_TRUE(stream != NULL);
+    EXPECT_TRUE(readAll(stream) == data);
+    stream = storage.stream("/Tail");
+    ASSERT_TRUE(stream != NULL);
+    EXPECT_TRUE(readAll(stream) == std::vector<unsigned char>(data.begin(), data.begin() + 10));
+}
+
+TEST(writer, append)
+{
+    std::vector<unsigned char> data(3000000);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (unsigned char)(i % 253);
+
+    POLE::MemoryDevice device;
+    {
+        POLE::Writer writer(&device);
+        ASSERT_TRUE(writer.open_stream_for_write("/Payload"));
+        EXPECT_FALSE(writer.add("/Other", data.data(), 10));
+        EXPECT_FALSE(writer.open_stream_for_write("/Other"));
+        for (size_t pos = 0; pos < data.size(); pos += 1000)
+            ASSERT_TRUE(writer.append(data.data() + pos, 1000));
+        EXPECT_TRUE(writer.close_stream());
+        EXPECT_FALSE(writer.append(data.data(), 1));
+
+        // stays small, then becomes big on the last piece
+        ASSERT_TRUE(writer.open_stream_for_write("/Dir/Small"));
+        EXPECT_TRUE(writer.append(data.data(), 1000));
+        EXPECT_TRUE(writer.append(data.data() + 1000, 1000));
+        EXPECT_TRUE(writer.close_stream());
+        ASSERT_TRUE(writer.open_stream_for_write("/Dir/Grown"));
+        EXPECT_TRUE(writer.append(data.data(), 4000));
+        EXPECT_TRUE(writer.append(data.data() + 4000, 96));
+        EXPECT_TRUE(writer.close_stream());
+        EXPECT_TRUE(writer.add("/Other", data.data(), 10));
+        ASSERT_TRUE(writer.open_stream_for_write("/Last"));
+        EXPECT_TRUE(writer.append(data.data(), 5000));
+        EXPECT_TRUE(writer.close());
+    }
+
+    std::unique_ptr<POLE::Storage> storage(POLE::Storage::from_memory(device.data(), device.size()));
+    ASSERT_EQ(storage->result(), POLE::Storage::Ok);
+    std::map<std::string, size_t> sizes = { { "/Payload", 3000000 }, { "/Dir/Small", 2000 }, { "/Dir/Grown", 4096 }, { "/Other", 10 }, { "/Last", 5000 } };
+    for (const auto& it : sizes)
+    {
+        POLE::Stream* stream = storage->stream(it.first);
+        ASSERT_TRUE(stream != NULL) << it.first;
+        EXPECT_TRUE(readAll(stream) == std::vector<unsigned char>(data.begin(), data.begin() + it.second)) << it.first;
+    }
+}
+
+// records the sectors written
+class WriteCountingDevice : public POLE::MemoryDevice
+{
+public:
+    size_t write_at(size_t pos, const unsigned char* buffer, size_t len)
+    {
+        for (size_t sector = pos / 512; sector * 512 < pos + len; sector++)
+            sectors.insert(sector);
+        return POLE::MemoryDevice::write_at(pos, buffer, len);
+    }
+    std::set<size_t> sectors;
+};
+
+TEST(storage, dirty_sectors)
+{
+    WriteCountingDevice device;
+    std::vector<unsigned char> bytes = loadTestDevice("test2.bin", device);
+    device.sectors.clear();
+    std::vector<unsigned char> tags;
+    {
+        POLE::Storage storage(&device);
+        ASSERT_EQ(storage.result(), POLE::Storage::Ok);
+        tags = readAll(storage.stream("/Tags"));
+
+        // the entries of a storage and its stream, and the link to them
+        ASSERT_TRUE(storage.delete_entry("/Image/Scaling/Tags"));
+        EXPECT_LE(device.sectors.size(), 2);
+        device.sectors.clear();
+        storage.flush();
+        EXPECT_EQ(device.sectors.size(), 0);
+
+        // the data, its entry and one sector of the small bat
+        POLE::Stream* stream = storage.stream("/Tags");
+        stream->seek(1518);
+        stream->write(bytes.data(), 100);
+        storage.flush();
+        EXPECT_LE(device.sectors.size(), 5);
+        tags.insert(tags.end(), bytes.begin(), bytes.begin() + 100);
+    }
+
+    std::unique_ptr<POLE::Storage> storage(POLE::Storage::from_memory(device.data(), device.size()));
+    ASSERT_EQ(storage->result(), POLE::Storage::Ok);
+    EXPECT_TRUE(storage->stream("/Image/Scaling/Tags") == NULL);
+    EXPECT_TRUE(readAll(storage->stream("/Tags")) == tags);
+    EXPECT_TRUE(readAll(storage->stream("/Image/Scaling/Contents")).size() == 330);
+}
+
+// keeps a copy of the device as it is at each flush
+class SnapshotDevice : public POLE::MemoryDevice
+{
+public:
+    bool sync()
+    {
+        images.push_back(std::vector<unsigned char>(data(), data() + size()));
+        return true;
+    }
+    std::vector<std::vector<unsigned char>> images;
+};
+
+static std::vector<unsigned char> readImageStream(const std::vector<unsigned char>& image, const std::string& name)
+{
+    std::unique_ptr<POLE::Storage> storage(POLE::Storage::from_memory(image.data(), image.size()));
+    EXPECT_EQ(storage->result(), POLE::Storage::Ok);
+    return readAll(storage->stream(name));
+}
+
+TEST(storage, transacted)
+{
+    SnapshotDevice device;
+    std::vector<unsigned char> bytes = loadTestDevice("test2.bin", device);
+    std::vector<unsigned char> thumbnail = readImageStream(bytes, "/Thumbnail");
+    std::vector<unsigned char> tags = readImageStream(bytes, "/Tags");
+    std::vector<unsigned char> contents = readImageStream(bytes, "/Image/Scaling/Contents");
+    std::vector<unsigned char> pattern(1000, 0x5a);
+    {
+        POLE::Storage storage(&device, POLE::Storage::Transacted);
+        ASSERT_EQ(storage.result(), POLE::Storage::Ok);
+        storage.stream("/Thumbnail")->write(pattern.data(), 1000);
+        POLE::Stream* stream = storage.stream("/Tags");
+        stream->seek(1518);
+        stream->write(pattern.data(), 100);
+        storage.stream("/Image/Scaling/Contents")->write(pattern.data(), 10);
+
+        // nothing the committed storage uses has changed
+        storage.flush();
+        std::vector<unsigned char> image(device.data(), device.data() + device.size());
+        EXPECT_TRUE(readImageStream(image, "/Thumbnail") == thumbnail);
+        EXPECT_TRUE(readImageStream(image, "/Tags") == tags);
+        EXPECT_TRUE(readImageStream(image, "/Image/Scaling/Contents") == contents);
+        EXPECT_TRUE(device.images.empty());
+
+        // the device is synced before and after the header changes
+        ASSERT_TRUE(storage.commit());
+        ASSERT_EQ(device.images.size(), 2);
+        EXPECT_TRUE(readImageStream(device.images[0], "/Thumbnail") == thumbnail);
+        memcpy(thumbnail.data(), pattern.data(), 1000);
+        tags.insert(tags.end(), pattern.begin(), pattern.begin() + 100);
+        memcpy(contents.data(), pattern.data(), 10);
+        image = device.images[1];
+        EXPECT_TRUE(readImageStream(image, "/Thumbnail") == thumbnail);
+        EXPECT_TRUE(readImageStream(image, "/Tags") == tags);
+        EXPECT_TRUE(readImageStream(image, "/Image/Scaling/Contents") == contents);
+
+        // changed again, not committed
+        storage.stream("/Thumbnail")->write(bytes.data(), 1000);
+        storage.stream("/Image/Scaling/Contents")->write(bytes.data(), 10);
+    }
+
+    std::vector<unsigned char> image(device.data(), device.data() + device.size());
+    EXPECT_TRUE(readImageStream(image, "/Thumbnail") == thumbnail);
+    EXPECT_TRUE(readImageStream(image, "/Tags") == tags);
+    EXPECT_TRUE(readImageStream(image, "/Image/Scaling/Contents") == contents);
+    EXPECT_EQ(readImageStream(image, "/Image/Item(0)/Contents").size(), 2887364);
+}
+
+TEST(stream, shared_entry)
+{
+    POLE::MemoryDevice device;
+    std::vector<unsigned char> bytes = loadTestDevice("test2.bin", device);
+    std::vector<unsigned char> thumbnail = readImageStream(bytes, "/Thumbnail");
+    std::vector<unsigned char> tags = readImageStream(bytes, "/Tags");
+    std::vector<unsigned char> pattern(5000, 0x5a);
+    {
+        POLE::Storage storage(&device, POLE::Storage::Transacted);
+        ASSERT_EQ(storage.result(), POLE::Storage::Ok);
+
+        // the first write moves the blocks the second stream knows
+        POLE::Stream* first = storage.stream("/Thumbnail");
+        POLE::Stream* second = storage.stream("/Thumbnail");
+        first->write(pattern.data(), 100);
+        second->seek(600);
+        second->write(pattern.data(), 100);
+
+        // moved from small to big blocks by the first stream
+        first = storage.stream("/Tags");
+        second = storage.stream("/Tags");
+        first->seek(1518);
+        first->write(pattern.data(), 5000);
+        second->seek(10);
+        second->write(pattern.data(), 10);
+        EXPECT_TRUE(readAll(second) == readAll(first));
+        ASSERT_TRUE(storage.commit());
+    }
+    memcpy(thumbnail.data(), pattern.data(), 100);
+    memcpy(thumbnail.data() + 600, pattern.data(), 100);
+    memcpy(tags.data() + 10, pattern.data(), 10);
+    tags.insert(tags.end(), pattern.begin(), pattern.end());
+
+    std::vector<unsigned char> image(device.data(), device.data() + device.size());
+    EXPECT_TRUE(readImageStream(image, "/Thumbnail") == thumbnail);
+    EXPECT_TRUE(readImageStream(image, "/Tags") == tags);
+}
+
+TEST(stream, read_at_after_write)
+{
+    POLE::MemoryDevice device;
+    loadTestDevice("test2.bin", device);
+    std::vector<unsigned char> pattern(5000, 0x5a);
+    POLE::Storage storage(&device, POLE::Storage::Transacted);
+    ASSERT_EQ(storage.result(), POLE::Storage::Ok);
+
+    // read_at of the second stream follows the blocks moved by the first
+    POLE::Stream* first = storage.stream("/Tags");
+    POLE::Stream* second = storage.stream("/Tags");
+    first->seek(10);
+    first->write(pattern.data(), 10);
+    first->seek(1518);
+    first->write(pattern.data(), 5000);
+    std::vector<unsigned char> data(second->size());
+    ASSERT_EQ(second->read_at(0, data.data(), data.size()), data.size());
+    EXPECT_TRUE(data == readAll(first));
+}
+
+TEST(storage, free_deleted_streams)
+{
+    POLE::MemoryDevice device;
+    std::vector<unsigned char> bytes = loadTestDevice("test2.bin", device);
+    std::vector<unsigned char> pattern(1000000, 0x5a);
+    std::vector<unsigned char> tags;
+    {
+        POLE::Storage storage(&device);
+        ASSERT_EQ(storage.result(), POLE::Storage::Ok);
+        POLE::Stream* stream = storage.stream("/Thumbnail");
+        stream->seek(stream->size());
+        stream->write(pattern.data(), pattern.size());
+        storage.flush();
+        EXPECT_GT(device.size(), bytes.size() + pattern.size());
+
+        // the blocks at the end of the file are cut off
+        ASSERT_TRUE(storage.delete_entry("/Thumbnail"));
+        EXPECT_LT(device.size(), bytes.size());
+
+        // the holes left are used again
+        stream = storage.stream("/Tags");
+        tags = readAll(stream);
+        stream->seek(stream->size());
+        stream->write(pattern.data(), 30000);
+        storage.flush();
+        EXPECT_LE(device.size(), bytes.size());
+        tags.insert(tags.end(), pattern.begin(), pattern.begin() + 30000);
+    }
+
+    std::unique_ptr<POLE::Storage> storage(POLE::Storage::from_memory(device.data(), device.size()));
+    ASSERT_EQ(storage->result(), POLE::Storage::Ok);
+    EXPECT_TRUE(storage->stream("/Thumbnail") == NULL);
+    EXPECT_TRUE(readAll(storage->stream("/Tags")) == tags);
+    EXPECT_EQ(readAll(storage->stream("/Image/Item(0)/Contents")).size(), 2887364);
+}